@@ -0,0 +1,530 @@
+/* bench_6502.c - cycle-count microbenchmarks for the sim65 (sim6502) target
+ *
+ * Usage (under sim65): bench_6502 <op> <n> <run>
+ *
+ * Each invocation performs the setup for <op> with problem size <n> and,
+ * when <run> is 1, the measured section: <n> operations of the given kind.
+ * tools/bench_6502.py runs every op with run=1 and run=0 under `sim65 -c`
+ * and divides the cycle difference by <n>, so setup cost cancels out.
+ *
+ * Exit code is 0 on success, 1 on a failed operation, 2 on bad arguments.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btree.h"
+#include "pubsub.h"
+#include "scheduler.h"
+
+static unsigned int n = 0;
+static unsigned char run = 0;
+static unsigned char failed = 0;
+
+/* ========== B-tree ========== */
+
+static BTree *tree = NULL;
+
+static void fill_tree(void)
+{
+    unsigned int i;
+    for (i = 0; i < n; ++i)
+        btree_insert(tree, i, (void *)(i + 1u));
+}
+
+static void bench_btree_insert(void)
+{
+    tree = btree_create();
+    if (run) fill_tree();
+}
+
+static void bench_btree_get(void)
+{
+    unsigned int i;
+    tree = btree_create();
+    fill_tree();
+    if (!run) return;
+    for (i = 0; i < n; ++i) {
+        if (btree_get(tree, i) != (void *)(i + 1u)) failed = 1;
+    }
+}
+
+static void bench_btree_delete(void)
+{
+    unsigned int i;
+    tree = btree_create();
+    fill_tree();
+    if (!run) return;
+    for (i = 0; i < n; ++i) {
+        if (!btree_delete(tree, i)) failed = 1;
+    }
+}
+
+/* One btree_range over all n keys, versus n btree_get descents */
+static unsigned int scanned = 0;
+
+static void scan_entry(unsigned int key, void *value, void *ctx)
+{
+    (void)ctx;
+    if (value != (void *)(key + 1u)) failed = 1;
+    ++scanned;
+}
+
+static void bench_btree_scan(void)
+{
+    tree = btree_create();
+    fill_tree();
+    if (!run) return;
+    btree_range(tree, 0, n - 1u, scan_entry, NULL);
+    if (scanned != n) failed = 1;
+}
+
+/* Churn: n cycles of delete-oldest/insert-new on a tree of n keys, with
+ * nodes from the heap or from a pool. Each op is one delete plus one
+ * insert. The heap variant reports how fragmented cc65's heap is left. */
+static BTreeNode churn_arena[64];
+static BTreePool churn_pool;
+
+static void churn(void)
+{
+    unsigned int i;
+    fill_tree();
+    if (!run) return;
+    for (i = 0; i < n; ++i) {
+        if (!btree_delete(tree, i)) failed = 1;
+        if (!btree_insert(tree, n + i, (void *)(i + 1u))) failed = 1;
+    }
+}
+
+static void bench_btree_churn_heap(void)
+{
+    tree = btree_create();
+    churn();
+#if defined(__CC65__)
+    printf("heap free %u, largest block %u\n", _heapmemavail(), _heapmaxavail());
+#endif
+}
+
+static void bench_btree_churn_pool(void)
+{
+    btree_pool_init(&churn_pool, churn_arena, sizeof(churn_arena) / sizeof(churn_arena[0]));
+    tree = btree_create_in_pool(&churn_pool);
+    churn();
+    if (churn_pool.failures) failed = 1;
+}
+
+/* Insert, get and delete n keys inside a scheduler task and report that
+ * task's C stack high-water mark, the footprint tree operations need. */
+static int stack_task = -1;
+
+static void btree_stack_driver(void *arg)
+{
+    unsigned int i;
+    (void)arg;
+    tree = btree_create();
+    if (run) {
+        fill_tree();
+        for (i = 0; i < n; ++i) {
+            if (btree_get(tree, i) != (void *)(i + 1u)) failed = 1;
+        }
+        for (i = 0; i < n; ++i) {
+            if (!btree_delete(tree, i)) failed = 1;
+        }
+    }
+    printf("task C stack high water %u bytes\n", scheduler_task_cstack_max_used(stack_task));
+    exit(failed);
+}
+
+static void bench_btree_task_stack(void)
+{
+    scheduler_init();
+    stack_task = scheduler_add(btree_stack_driver, NULL);
+    scheduler_run();
+}
+
+/* ========== Pub/sub ========== */
+
+static PubSubManager mgr;
+static int topic = -1;
+static unsigned int delivered = 0;
+
+static void count_subscriber(const char *topic, const PubSubMessage *message, void *user_data)
+{
+    (void)topic;
+    (void)message;
+    (void)user_data;
+    ++delivered;
+}
+
+static void count_batch(const char *topic, const PubSubMessage *messages,
+                        unsigned int count, void *user_data)
+{
+    (void)topic;
+    (void)messages;
+    (void)user_data;
+    delivered += count;
+}
+
+static void publish_n(void)
+{
+    unsigned int i;
+    PubSubMessage msg;
+    for (i = 0; i < n; ++i) {
+        msg.key = (int)i;
+        msg.value = (void *)i;
+        if (!pubsub_publish(&mgr, "bench", &msg)) failed = 1;
+    }
+}
+
+static void publish_n_id(void)
+{
+    unsigned int i;
+    PubSubMessage msg;
+    for (i = 0; i < n; ++i) {
+        msg.key = (int)i;
+        msg.value = (void *)i;
+        if (!pubsub_publish_id(&mgr, topic, &msg)) failed = 1;
+    }
+}
+
+/* 64-message ring so n = 63 fits one queue */
+static int bench_topic(const char *name, unsigned char spsc)
+{
+    PubSubTopicConfig config;
+    pubsub_topic_config_init(&config);
+    config.depth = 64;
+    config.spsc = spsc;
+    return pubsub_create_topic_ex(&mgr, name, &config);
+}
+
+static void pubsub_setup(void)
+{
+    pubsub_init(&mgr);
+    topic = bench_topic("bench", 0);
+    pubsub_subscribe(&mgr, "bench", count_subscriber, NULL);
+}
+
+static void bench_pubsub_publish(void)
+{
+    pubsub_setup();
+    if (run) publish_n();
+}
+
+static void bench_pubsub_process_topic(void)
+{
+    pubsub_setup();
+    publish_n();
+    if (!run) return;
+    pubsub_process_topic(&mgr, "bench");
+    if (delivered != n) failed = 1;
+}
+
+static void pubsub_setup_spsc(void)
+{
+    pubsub_init(&mgr);
+    topic = bench_topic("bench", 1);
+    pubsub_subscribe_id(&mgr, topic, count_subscriber, NULL);
+}
+
+static void bench_pubsub_publish_spsc(void)
+{
+    pubsub_setup_spsc();
+    if (run) publish_n_id();
+}
+
+static void bench_pubsub_process_spsc(void)
+{
+    pubsub_setup_spsc();
+    publish_n_id();
+    if (!run) return;
+    pubsub_process_id(&mgr, topic);
+    if (delivered != n) failed = 1;
+}
+
+/* n messages in one call; the array is filled during setup */
+static PubSubMessage batch[64];
+
+static void pubsub_setup_batch(void)
+{
+    unsigned int i;
+    pubsub_init(&mgr);
+    topic = bench_topic("bench", 0);
+    pubsub_subscribe_batch_id(&mgr, topic, count_batch, NULL);
+    for (i = 0; i < n && i < 64; ++i) {
+        batch[i].key = (int)i;
+        batch[i].value = (void *)i;
+    }
+}
+
+static void bench_pubsub_publish_batch(void)
+{
+    pubsub_setup_batch();
+    if (run && pubsub_publish_batch_id(&mgr, topic, batch, n) != n) failed = 1;
+}
+
+static void bench_pubsub_process_batch(void)
+{
+    pubsub_setup_batch();
+    if (pubsub_publish_batch_id(&mgr, topic, batch, n) != n) failed = 1;
+    if (!run) return;
+    pubsub_process_id(&mgr, topic);
+    if (delivered != n) failed = 1;
+}
+
+static void reserve_n(void)
+{
+    unsigned int i;
+    PubSubMessage *slot;
+    for (i = 0; i < n; ++i) {
+        slot = pubsub_reserve_id(&mgr, topic);
+        if (!slot) {
+            failed = 1;
+            return;
+        }
+        slot->key = (int)i;
+        slot->value = (void *)i;
+        pubsub_commit_id(&mgr, topic);
+    }
+}
+
+static void bench_pubsub_reserve_commit(void)
+{
+    pubsub_init(&mgr);
+    topic = bench_topic("bench", 0);
+    if (run) reserve_n();
+}
+
+static void bench_pubsub_peek_release(void)
+{
+    const PubSubMessage *in;
+    pubsub_init(&mgr);
+    topic = bench_topic("bench", 0);
+    reserve_n();
+    if (!run) return;
+    while ((in = pubsub_peek_id(&mgr, topic)) != NULL) {
+        if (in->key == (int)delivered) ++delivered;
+        pubsub_release_id(&mgr, topic);
+    }
+    if (delivered != n) failed = 1;
+}
+
+/* 16-byte inline payload copied into each slot; the slots are a static
+ * buffer since 64 of them would fill the default pool */
+static unsigned char payload[16];
+static unsigned char payload_slots[64 * sizeof(payload)];
+
+static void bench_pubsub_publish_payload(void)
+{
+    PubSubTopicConfig config;
+    unsigned int i;
+    pubsub_init(&mgr);
+    pubsub_topic_config_init(&config);
+    config.depth = 64;
+    config.payload_size = sizeof(payload);
+    config.payload_buffer = payload_slots;
+    topic = pubsub_create_topic_ex(&mgr, "bench", &config);
+    if (!run) return;
+    for (i = 0; i < n; ++i) {
+        if (!pubsub_publish_payload_id(&mgr, topic, (int)i, payload, sizeof(payload)))
+            failed = 1;
+    }
+}
+
+/* pubsub_process_all over PUBSUB_MAX_TOPICS empty topics: the cost of
+ * a polling round that finds nothing to do */
+static void bench_pubsub_process_all_idle(void)
+{
+    char name[8];
+    unsigned int i;
+    pubsub_init(&mgr);
+    for (i = 0; i < PUBSUB_MAX_TOPICS; ++i) {
+        sprintf(name, "t%u", i);
+        if (pubsub_create_topic(&mgr, name) < 0) failed = 1;
+    }
+    if (!run) return;
+    for (i = 0; i < n; ++i)
+        pubsub_process_all(&mgr);
+}
+
+/* Same as pubsub_process_id, with every other subscriber slot taken by a
+ * second topic: dispatch should not pay for them */
+static void bench_pubsub_dispatch_full(void)
+{
+    unsigned char i;
+    int other;
+    pubsub_setup();
+    other = bench_topic("other", 0);
+    for (i = 1; i < PUBSUB_MAX_SUBSCRIBERS; ++i)
+        pubsub_subscribe_id(&mgr, other, count_subscriber, NULL);
+    publish_n_id();
+    if (!run) return;
+    pubsub_process_id(&mgr, topic);
+    if (delivered != n) failed = 1;
+}
+
+static void bench_pubsub_publish_id(void)
+{
+    pubsub_setup();
+    if (run) publish_n_id();
+}
+
+static void bench_pubsub_process_id(void)
+{
+    pubsub_setup();
+    publish_n_id();
+    if (!run) return;
+    pubsub_process_id(&mgr, topic);
+    if (delivered != n) failed = 1;
+}
+
+/* ========== Context switch ========== */
+
+static unsigned int switches = 0;
+
+static void switch_driver(void *arg)
+{
+    (void)arg;
+    while (switches < n) {
+        ++switches;
+        scheduler_yield();
+    }
+    /* scheduler_run() never returns on the 6502; leave from here */
+    exit(failed);
+}
+
+/* Yield with DEEP_FRAMES extra return addresses (2 bytes each) on page 1,
+ * so ctx_switch_deep shows the per-byte cost of the stack copy. */
+#define DEEP_FRAMES 32
+static unsigned char depth_left = 0;
+
+static void deep_yield(void)
+{
+    if (depth_left) {
+        --depth_left;
+        deep_yield();
+    } else {
+        ++switches;
+        scheduler_yield();
+    }
+}
+
+static void switch_driver_deep(void *arg)
+{
+    (void)arg;
+    while (switches < n) {
+        depth_left = DEEP_FRAMES;
+        deep_yield();
+    }
+    exit(failed);
+}
+
+static void switch_partner(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        ++switches;
+        scheduler_yield();
+    }
+}
+
+static void bench_ctx_switch(void)
+{
+    scheduler_init();
+    scheduler_add(switch_driver, NULL);
+    scheduler_add(switch_partner, NULL);
+    if (!run) n = 0;
+    scheduler_run();
+}
+
+static void bench_ctx_switch_deep(void)
+{
+    scheduler_init();
+    scheduler_add(switch_driver_deep, NULL);
+    scheduler_add(switch_partner, NULL);
+    if (!run) n = 0;
+    scheduler_run();
+}
+
+/* Two tasks ping-pong while SLEEPERS others sleep far in the future;
+ * compare with ctx_switch to see what sleeping tasks add to a yield. */
+static void sleeper(void *arg)
+{
+    (void)arg;
+    for (;;) scheduler_sleep(30000u);
+}
+
+static void bench_yield_sleepers(unsigned char sleepers)
+{
+    unsigned char i;
+    scheduler_init();
+    for (i = 0; i < sleepers; ++i) scheduler_add(sleeper, NULL);
+    scheduler_add(switch_driver, NULL);
+    scheduler_add(switch_partner, NULL);
+    if (!run) n = 0;
+    scheduler_run();
+}
+
+static void bench_yield_sleepers_2(void)
+{
+    bench_yield_sleepers(2);
+}
+
+static void bench_yield_sleepers_13(void)
+{
+    bench_yield_sleepers(SCHED_MAX_TASKS - 2);
+}
+
+/* ========== Driver ========== */
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+} bench_op_t;
+
+static const bench_op_t ops[] = {
+    { "btree_insert", bench_btree_insert },
+    { "btree_get", bench_btree_get },
+    { "btree_scan", bench_btree_scan },
+    { "btree_delete", bench_btree_delete },
+    { "btree_churn_heap", bench_btree_churn_heap },
+    { "btree_churn_pool", bench_btree_churn_pool },
+    { "btree_task_stack", bench_btree_task_stack },
+    { "pubsub_publish", bench_pubsub_publish },
+    { "pubsub_process_topic", bench_pubsub_process_topic },
+    { "pubsub_publish_id", bench_pubsub_publish_id },
+    { "pubsub_process_id", bench_pubsub_process_id },
+    { "pubsub_dispatch_full", bench_pubsub_dispatch_full },
+    { "pubsub_publish_spsc", bench_pubsub_publish_spsc },
+    { "pubsub_process_spsc", bench_pubsub_process_spsc },
+    { "pubsub_publish_batch", bench_pubsub_publish_batch },
+    { "pubsub_process_batch", bench_pubsub_process_batch },
+    { "pubsub_reserve_commit", bench_pubsub_reserve_commit },
+    { "pubsub_peek_release", bench_pubsub_peek_release },
+    { "pubsub_publish_payload", bench_pubsub_publish_payload },
+    { "pubsub_process_all_idle", bench_pubsub_process_all_idle },
+    { "ctx_switch", bench_ctx_switch },
+    { "ctx_switch_deep", bench_ctx_switch_deep },
+    { "yield_sleepers_2", bench_yield_sleepers_2 },
+    { "yield_sleepers_13", bench_yield_sleepers_13 },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned char i;
+
+    if (argc < 4) {
+        puts("usage: bench_6502 <op> <n> <run>");
+        return 2;
+    }
+    n = (unsigned int)atoi(argv[2]);
+    run = (unsigned char)(atoi(argv[3]) != 0);
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if (strcmp(argv[1], ops[i].name) == 0) {
+            ops[i].fn();
+            if (failed) printf("%s: operation failed\n", ops[i].name);
+            return failed;
+        }
+    }
+    printf("unknown op: %s\n", argv[1]);
+    return 2;
+}
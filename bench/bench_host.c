@@ -0,0 +1,1120 @@
+/* bench_host.c - host-native throughput benchmark for btree/pubsub/scheduler
+ *
+ * Runs parameterized workloads against the same sources that go into the
+ * ROM and reports operations per second and heap allocations per phase.
+ *
+ * Usage: bench_host [-n items] [-r rounds] [-s seed] [-S subscribers]
+ *                   [-k tasks] [-q] [-c] [workload...]
+ *   workloads: btree pubsub dispatch yield sleepers mutex (default: all)
+ *   dispatch: process cost of a one-subscriber topic while 0..31 other
+ *             subscribers exist on another topic
+ *   sleepers: two yielding tasks plus 2..13 sleeping ones (4..15 tasks)
+ *   mutex: uncontended lock/unlock, then -k tasks each holding the pubsub
+ *          manager lock across a yield (fails on lost updates or a hang)
+ *   -q  insert btree keys in ascending order instead of shuffled
+ *   -c  print CSV instead of a table
+ *
+ * Exits non-zero if any operation returned an unexpected result.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "btree.h"
+#include "pubsub.h"
+#include "scheduler.h"
+
+/* ========== Allocation accounting ========== */
+
+static unsigned long alloc_calls = 0;
+static unsigned long free_calls = 0;
+
+#if BENCH_WRAP_MALLOC
+/* Linked with -Wl,--wrap=malloc,--wrap=free so calls made by the
+ * libraries under test are counted. */
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    ++alloc_calls;
+    return __real_malloc(size);
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr) ++free_calls;
+    __real_free(ptr);
+}
+#endif
+
+/* ========== Options and reporting ========== */
+
+static unsigned int opt_items = 10000;
+static unsigned int opt_rounds = 5;
+static unsigned int opt_seed = 42;
+static unsigned int opt_subscribers = 1;
+static unsigned int opt_tasks = 4;
+static int opt_sequential = 0;
+static int opt_csv = 0;
+static unsigned long total_failures = 0;
+
+typedef struct {
+    const char *workload;
+    const char *op;
+    unsigned long ops;
+    double seconds;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long failures;
+} bench_result_t;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void result_begin(bench_result_t *r, const char *workload, const char *op)
+{
+    memset(r, 0, sizeof(*r));
+    r->workload = workload;
+    r->op = op;
+}
+
+/* Add one timed section; alloc counters are sampled by the caller */
+static void result_add(bench_result_t *r, unsigned long ops, double seconds,
+                       unsigned long allocs, unsigned long frees)
+{
+    r->ops += ops;
+    r->seconds += seconds;
+    r->allocs += allocs;
+    r->frees += frees;
+}
+
+static void print_header(void)
+{
+    if (opt_csv) {
+        printf("workload,op,ops,seconds,ops_per_sec,allocs,frees,failures\n");
+    } else {
+        printf("%-8s %-16s %10s %10s %14s %10s %10s %8s\n",
+               "workload", "op", "ops", "seconds", "ops/sec", "allocs", "frees", "fail");
+    }
+}
+
+static void print_result(const bench_result_t *r)
+{
+    double rate = r->seconds > 0.0 ? (double)r->ops / r->seconds : 0.0;
+
+    total_failures += r->failures;
+
+    if (opt_csv) {
+        printf("%s,%s,%lu,%.6f,%.0f,%lu,%lu,%lu\n", r->workload, r->op, r->ops,
+               r->seconds, rate, r->allocs, r->frees, r->failures);
+    } else {
+        printf("%-8s %-16s %10lu %10.4f %14.0f %10lu %10lu %8lu\n", r->workload, r->op,
+               r->ops, r->seconds, rate, r->allocs, r->frees, r->failures);
+    }
+}
+
+/* Simple pseudo-random generator (same LCG as main.c) */
+static unsigned int random_seed = 42u;
+
+static unsigned int pseudo_random(void)
+{
+    random_seed = (1103515245u * random_seed + 12345u) & 0x7FFFFFFFu;
+    return random_seed;
+}
+
+/* ========== B-tree workload ========== */
+
+/* btree_range callback: counts entries that arrive in order with the
+ * value the get pass checks */
+static unsigned long scan_seen;
+static unsigned long scan_bad;
+static unsigned int scan_last;
+
+static void scan_entry(unsigned int key, void *value, void *ctx)
+{
+    (void)ctx;
+    if (value != (void *)(unsigned long)(key + 1u) || (scan_seen && key <= scan_last))
+        ++scan_bad;
+    scan_last = key;
+    ++scan_seen;
+}
+
+static void bench_btree(void)
+{
+    bench_result_t r_insert, r_get, r_scan, r_update, r_delete;
+    unsigned int *keys;
+    unsigned int i, round;
+    unsigned long nodes = 0;
+
+    keys = (unsigned int *)malloc(opt_items * sizeof(unsigned int));
+    if (!keys) {
+        fprintf(stderr, "bench_btree: out of memory\n");
+        return;
+    }
+
+    result_begin(&r_insert, "btree", "insert");
+    result_begin(&r_get, "btree", "get");
+    result_begin(&r_scan, "btree", "scan");
+    result_begin(&r_update, "btree", "update");
+    result_begin(&r_delete, "btree", "delete");
+
+    for (round = 0; round < opt_rounds; ++round) {
+        BTree *tree;
+        double t0;
+        unsigned long a0, f0;
+
+        /* Keys 0..n-1, optionally shuffled (Fisher-Yates) */
+        for (i = 0; i < opt_items; ++i) keys[i] = i;
+        if (!opt_sequential) {
+            for (i = opt_items; i > 1; --i) {
+                unsigned int j = pseudo_random() % i;
+                unsigned int tmp = keys[i - 1];
+                keys[i - 1] = keys[j];
+                keys[j] = tmp;
+            }
+        }
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        tree = btree_create();
+        for (i = 0; i < opt_items; ++i)
+            btree_insert(tree, keys[i], (void *)(unsigned long)(keys[i] + 1u));
+        result_add(&r_insert, opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+        nodes += btree_node_count(tree);
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        for (i = 0; i < opt_items; ++i) {
+            if (btree_get(tree, keys[i]) != (void *)(unsigned long)(keys[i] + 1u))
+                ++r_get.failures;
+        }
+        result_add(&r_get, opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        /* Every key in order through btree_range, versus one get each */
+        scan_seen = scan_bad = 0;
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        if (btree_range(tree, 0, opt_items - 1u, scan_entry, NULL) != opt_items)
+            ++r_scan.failures;
+        result_add(&r_scan, opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+        if (scan_bad || scan_seen != opt_items)
+            ++r_scan.failures;
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        for (i = 0; i < opt_items; ++i) {
+            if (!btree_update(tree, keys[i], (void *)(unsigned long)(keys[i] + 2u)))
+                ++r_update.failures;
+        }
+        result_add(&r_update, opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        for (i = 0; i < opt_items; ++i) {
+            if (!btree_delete(tree, keys[i]))
+                ++r_delete.failures;
+        }
+        result_add(&r_delete, opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        btree_free(tree);
+    }
+
+    print_result(&r_insert);
+    print_result(&r_get);
+    print_result(&r_scan);
+    print_result(&r_update);
+    print_result(&r_delete);
+    if (!opt_csv)
+        printf("# btree: order %u%s, %lu nodes of %u bytes after insert (avg)\n",
+               (unsigned int)BTREE_MAX_CHILDREN, BTREE_BPLUS ? " B+" : "",
+               nodes / opt_rounds, (unsigned int)sizeof(BTreeNode));
+
+    free(keys);
+}
+
+/* Insert/delete churn on a steady-state tree: each cycle deletes the
+ * oldest key and inserts a new one. Nodes come from the heap or from a
+ * node pool; the allocs/frees columns show the heap traffic the pool
+ * removes. */
+static void bench_btree_churn(int pooled)
+{
+    bench_result_t r;
+    BTreeNode *arena = NULL;
+    BTreePool pool;
+    unsigned int capacity = opt_items + 16u;
+    unsigned int round, i;
+    unsigned int high_water = 0;
+
+    result_begin(&r, "btree", pooled ? "churn/pool" : "churn/heap");
+    if (pooled) {
+        arena = (BTreeNode *)malloc(capacity * sizeof(BTreeNode));
+        if (!arena) {
+            fprintf(stderr, "bench_btree_churn: out of memory\n");
+            return;
+        }
+    }
+
+    for (round = 0; round < opt_rounds; ++round) {
+        BTree *tree;
+        unsigned long a0, f0;
+        double t0;
+
+        if (pooled) {
+            btree_pool_init(&pool, arena, capacity);
+            tree = btree_create_in_pool(&pool);
+        } else {
+            tree = btree_create();
+        }
+        for (i = 0; i < opt_items; ++i)
+            btree_insert(tree, i, (void *)(unsigned long)(i + 1u));
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        for (i = 0; i < opt_items; ++i) {
+            if (!btree_delete(tree, i))
+                ++r.failures;
+            if (!btree_insert(tree, opt_items + i, (void *)(unsigned long)(i + 1u)))
+                ++r.failures;
+        }
+        result_add(&r, 2ul * opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        btree_free(tree);
+        if (pooled) {
+            if (pool.in_use != 0 || pool.failures != 0)
+                ++r.failures;
+            high_water = pool.high_water;
+        }
+    }
+
+    print_result(&r);
+    if (pooled && !opt_csv)
+        printf("# btree: pool high water %u of %u nodes\n", high_water, capacity);
+    free(arena);
+}
+
+/* ========== Pub/sub workload ========== */
+
+static PubSubManager bench_mgr;
+static unsigned long delivered = 0;
+
+static void bench_subscriber(const char *topic, const PubSubMessage *message, void *user_data)
+{
+    (void)topic;
+    (void)message;
+    (void)user_data;
+    ++delivered;
+}
+
+/* Bench topics keep the 64-message ring the queue used to have */
+#define BENCH_DEPTH 64
+
+static int bench_topic(const char *name, unsigned char spsc)
+{
+    PubSubTopicConfig config;
+    pubsub_topic_config_init(&config);
+    config.depth = BENCH_DEPTH;
+    config.spsc = spsc;
+    return pubsub_create_topic_ex(&bench_mgr, name, &config);
+}
+
+#define PASS_NAMES 0 /* name-based calls */
+#define PASS_IDS 1   /* topic handle calls */
+#define PASS_SPSC 2  /* topic handle calls on a lock-free SPSC topic */
+#define PASS_BATCH 3 /* batch publish into batch subscribers */
+#define PASS_ZEROCOPY 4 /* reserve/commit, drained with peek/release */
+
+static void bench_batch_subscriber(const char *topic, const PubSubMessage *messages,
+                                   unsigned int count, void *user_data)
+{
+    (void)topic;
+    (void)messages;
+    (void)user_data;
+    delivered += count;
+}
+
+static void bench_pubsub_pass(int mode)
+{
+    static const char *publish_ops[] = { "publish", "publish_id", "publish_spsc", "publish_batch",
+                                         "reserve_commit" };
+    static const char *process_ops[] = { "process", "process_id", "process_spsc", "process_batch",
+                                         "peek_release" };
+    static PubSubMessage batch_msgs[BENCH_DEPTH];
+    bench_result_t r_publish, r_process;
+    unsigned int round, i;
+    PubSubMessage msg, *slot;
+    const PubSubMessage *in;
+    int topic;
+    int use_ids = mode != PASS_NAMES;
+    unsigned long fanout = mode == PASS_ZEROCOPY ? 1 : opt_subscribers;
+
+    result_begin(&r_publish, "pubsub", publish_ops[mode]);
+    result_begin(&r_process, "pubsub", process_ops[mode]);
+
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned int sent = 0;
+        bool ok;
+
+        pubsub_init(&bench_mgr);
+        topic = bench_topic("bench", mode == PASS_SPSC);
+        for (i = 0; mode != PASS_ZEROCOPY && i < opt_subscribers; ++i) {
+            if (mode == PASS_BATCH)
+                pubsub_subscribe_batch_id(&bench_mgr, topic, bench_batch_subscriber, NULL);
+            else
+                pubsub_subscribe_id(&bench_mgr, topic, bench_subscriber, NULL);
+        }
+        delivered = 0;
+
+        /* Fill the queue, drain it, repeat until all items went through */
+        while (sent < opt_items) {
+            unsigned int batch = 0;
+            unsigned long a0 = alloc_calls, f0 = free_calls;
+            double t0 = now_seconds();
+
+            if (mode == PASS_BATCH) {
+                unsigned int want = opt_items - sent;
+                if (want > BENCH_DEPTH)
+                    want = BENCH_DEPTH;
+                for (i = 0; i < want; ++i) {
+                    batch_msgs[i].key = (int)(sent + i);
+                    batch_msgs[i].value = (void *)(unsigned long)(sent + i);
+                }
+                batch = pubsub_publish_batch_id(&bench_mgr, topic, batch_msgs, want);
+                sent += batch;
+            }
+            while (mode == PASS_ZEROCOPY && sent < opt_items) {
+                slot = pubsub_reserve_id(&bench_mgr, topic);
+                if (!slot)
+                    break;
+                slot->key = (int)sent;
+                slot->value = (void *)(unsigned long)sent;
+                pubsub_commit_id(&bench_mgr, topic);
+                ++sent;
+                ++batch;
+            }
+            while (mode < PASS_BATCH && sent < opt_items) {
+                msg.key = (int)sent;
+                msg.value = (void *)(unsigned long)sent;
+                if (use_ids) ok = pubsub_publish_id(&bench_mgr, topic, &msg);
+                else ok = pubsub_publish(&bench_mgr, "bench", &msg);
+                if (!ok)
+                    break;
+                ++sent;
+                ++batch;
+            }
+            result_add(&r_publish, batch, now_seconds() - t0,
+                       alloc_calls - a0, free_calls - f0);
+
+            a0 = alloc_calls; f0 = free_calls;
+            t0 = now_seconds();
+            if (mode == PASS_ZEROCOPY) {
+                while ((in = pubsub_peek_id(&bench_mgr, topic)) != NULL) {
+                    if (in->key >= 0)
+                        ++delivered;
+                    pubsub_release_id(&bench_mgr, topic);
+                }
+            }
+            else if (use_ids) pubsub_process_id(&bench_mgr, topic);
+            else pubsub_process_topic(&bench_mgr, "bench");
+            result_add(&r_process, batch, now_seconds() - t0,
+                       alloc_calls - a0, free_calls - f0);
+
+            if (batch == 0) {
+                ++r_publish.failures;
+                break;
+            }
+        }
+
+        if (delivered != (unsigned long)sent * fanout)
+            ++r_process.failures;
+    }
+
+    print_result(&r_publish);
+    print_result(&r_process);
+}
+
+/* Payload copies: 16-byte inline slots, or 64-byte pooled buffers that
+ * the producer releases right after publishing */
+#define BENCH_PAYLOAD 16
+#define BENCH_BUFFER 64
+
+static void bench_payload_pass(bool pooled)
+{
+    static unsigned char ring_payload[BENCH_DEPTH * BENCH_PAYLOAD];
+    static unsigned char buffer_storage[PUBSUB_MAX_BUFFERS * BENCH_BUFFER];
+    static PubSubBufferPool pool;
+    unsigned char data[BENCH_PAYLOAD];
+    bench_result_t r_publish, r_process;
+    PubSubTopicConfig config;
+    PubSubMessage msg;
+    unsigned int round, i;
+    int topic;
+    bool ok;
+
+    result_begin(&r_publish, "pubsub", pooled ? "publish_buffer" : "publish_payload");
+    result_begin(&r_process, "pubsub", pooled ? "process_buffer" : "process_payload");
+    memset(data, 0x5A, sizeof(data));
+
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned int sent = 0;
+
+        pubsub_init(&bench_mgr);
+        pubsub_topic_config_init(&config);
+        config.depth = BENCH_DEPTH;
+        if (pooled) {
+            pubsub_buffers_init(&pool, buffer_storage, BENCH_BUFFER, PUBSUB_MAX_BUFFERS);
+            config.buffers = &pool;
+        } else {
+            config.payload_size = BENCH_PAYLOAD;
+            config.payload_buffer = ring_payload;
+        }
+        topic = pubsub_create_topic_ex(&bench_mgr, "bench", &config);
+        for (i = 0; i < opt_subscribers; ++i)
+            pubsub_subscribe_id(&bench_mgr, topic, bench_subscriber, NULL);
+        delivered = 0;
+
+        while (sent < opt_items) {
+            unsigned int batch = 0;
+            unsigned long a0 = alloc_calls, f0 = free_calls;
+            double t0 = now_seconds();
+
+            while (sent < opt_items) {
+                if (pooled) {
+                    msg.key = (int)sent;
+                    msg.value = pubsub_buffer_alloc(&pool);
+                    if (!msg.value)
+                        break;
+                    memcpy(msg.value, data, sizeof(data));
+                    ok = pubsub_publish_id(&bench_mgr, topic, &msg);
+                    pubsub_buffer_release(&pool, msg.value);
+                } else {
+                    ok = pubsub_publish_payload_id(&bench_mgr, topic, (int)sent,
+                                                   data, sizeof(data));
+                }
+                if (!ok)
+                    break;
+                ++sent;
+                ++batch;
+            }
+            result_add(&r_publish, batch, now_seconds() - t0,
+                       alloc_calls - a0, free_calls - f0);
+
+            a0 = alloc_calls; f0 = free_calls;
+            t0 = now_seconds();
+            pubsub_process_id(&bench_mgr, topic);
+            result_add(&r_process, batch, now_seconds() - t0,
+                       alloc_calls - a0, free_calls - f0);
+
+            if (batch == 0) {
+                ++r_publish.failures;
+                break;
+            }
+        }
+
+        if (delivered != (unsigned long)sent * opt_subscribers)
+            ++r_process.failures;
+        /* Every buffer must be back once the queue has drained */
+        if (pooled && pubsub_buffers_available(&pool) != PUBSUB_MAX_BUFFERS)
+            ++r_process.failures;
+    }
+
+    print_result(&r_publish);
+    print_result(&r_process);
+}
+
+/* Backpressure: a producer task publishing with pubsub_publish_wait into
+ * a task that drains the topic between yields. Throughput is items
+ * through the pair, including the switches blocking costs. */
+static int wait_topic = -1;
+static unsigned int wait_failures = 0;
+
+static void wait_producer(void *arg)
+{
+    unsigned int i;
+    PubSubMessage msg;
+    (void)arg;
+    for (i = 0; i < opt_items; ++i) {
+        msg.key = (int)i;
+        msg.value = NULL;
+        if (!pubsub_publish_wait_id(&bench_mgr, wait_topic, &msg)) {
+            ++wait_failures;
+            return;
+        }
+    }
+}
+
+static void wait_consumer(void *arg)
+{
+    (void)arg;
+    while (delivered < opt_items && !wait_failures) {
+        pubsub_process_id(&bench_mgr, wait_topic);
+        scheduler_yield();
+    }
+}
+
+static void bench_pubsub_wait(void)
+{
+    bench_result_t r;
+    unsigned int round;
+
+    result_begin(&r, "pubsub", "publish_wait");
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned long a0, f0;
+        double t0;
+
+        scheduler_init();
+        pubsub_init(&bench_mgr);
+        wait_topic = bench_topic("bench", 0);
+        pubsub_subscribe_id(&bench_mgr, wait_topic, bench_subscriber, NULL);
+        delivered = 0;
+        wait_failures = 0;
+        scheduler_add(wait_producer, NULL);
+        scheduler_add(wait_consumer, NULL);
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        scheduler_run();
+        result_add(&r, delivered, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+        if (delivered != opt_items || wait_failures)
+            ++r.failures;
+    }
+    print_result(&r);
+}
+
+/* publish_wait must fail rather than spin when draining cannot help: a
+ * publish between the task's own reserve and commit, and a pool buffer
+ * queued through publish_wait until it has 255 holders */
+static PubSubBufferPool refuse_pool;
+
+static void refuse_producer(void *arg)
+{
+    PubSubMessage msg;
+    PubSubMessage *slot;
+    unsigned int i;
+    (void)arg;
+
+    msg.key = 0;
+    msg.value = NULL;
+    slot = pubsub_reserve_id(&bench_mgr, wait_topic);
+    if (!slot) {
+        ++wait_failures;
+        return;
+    }
+    *slot = msg;
+    if (pubsub_publish_wait_id(&bench_mgr, wait_topic, &msg))
+        ++wait_failures;
+    if (!pubsub_commit_id(&bench_mgr, wait_topic))
+        ++wait_failures;
+
+    /* The queued copy is the second holder; fill the rest by hand */
+    msg.value = pubsub_buffer_alloc(&refuse_pool);
+    if (!msg.value || !pubsub_publish_wait_id(&bench_mgr, wait_topic, &msg)) {
+        ++wait_failures;
+        return;
+    }
+    for (i = 2; i < 255; ++i) {
+        if (!pubsub_buffer_ref(&refuse_pool, msg.value))
+            ++wait_failures;
+    }
+    if (pubsub_publish_wait_id(&bench_mgr, wait_topic, &msg))
+        ++wait_failures;
+    for (i = 1; i < 255; ++i)
+        pubsub_buffer_release(&refuse_pool, msg.value);
+}
+
+static void bench_pubsub_refuse(void)
+{
+    static unsigned char storage[PUBSUB_MAX_BUFFERS * BENCH_BUFFER];
+    bench_result_t r;
+    PubSubTopicConfig config;
+    unsigned long a0, f0;
+    double t0;
+
+    result_begin(&r, "pubsub", "publish_wait_refuse");
+    scheduler_init();
+    pubsub_init(&bench_mgr);
+    pubsub_buffers_init(&refuse_pool, storage, BENCH_BUFFER, PUBSUB_MAX_BUFFERS);
+    pubsub_topic_config_init(&config);
+    config.depth = BENCH_DEPTH;
+    config.buffers = &refuse_pool;
+    wait_topic = pubsub_create_topic_ex(&bench_mgr, "bench", &config);
+    pubsub_subscribe_id(&bench_mgr, wait_topic, bench_subscriber, NULL);
+    delivered = 0;
+    wait_failures = 0;
+    scheduler_add(refuse_producer, NULL);
+
+    a0 = alloc_calls; f0 = free_calls;
+    t0 = now_seconds();
+    scheduler_run();
+    pubsub_process_id(&bench_mgr, wait_topic);
+    result_add(&r, delivered, now_seconds() - t0,
+               alloc_calls - a0, free_calls - f0);
+    /* Only the committed slot and the first buffer publish were queued */
+    if (delivered != 2 || wait_failures ||
+        pubsub_buffers_available(&refuse_pool) != PUBSUB_MAX_BUFFERS)
+        ++r.failures;
+    print_result(&r);
+}
+
+/* Event-driven dispatch: the producer yields after every publish and a
+ * consumer task from pubsub_start_consumer wakes to deliver it */
+static void wake_producer(void *arg)
+{
+    unsigned int i;
+    PubSubMessage msg;
+    (void)arg;
+    for (i = 0; i < opt_items; ++i) {
+        msg.key = (int)i;
+        msg.value = NULL;
+        if (!pubsub_publish_id(&bench_mgr, wait_topic, &msg))
+            ++wait_failures;
+        scheduler_yield();
+    }
+}
+
+static void bench_pubsub_wake(void)
+{
+    bench_result_t r;
+    unsigned int round;
+
+    result_begin(&r, "pubsub", "publish_wake");
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned long a0, f0;
+        double t0;
+
+        scheduler_init();
+        pubsub_init(&bench_mgr);
+        wait_topic = bench_topic("bench", 0);
+        pubsub_subscribe_id(&bench_mgr, wait_topic, bench_subscriber, NULL);
+        delivered = 0;
+        wait_failures = 0;
+        if (pubsub_start_consumer_id(&bench_mgr, wait_topic, SCHED_PRIO_HIGH) < 0)
+            ++r.failures;
+        scheduler_add(wake_producer, NULL);
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        scheduler_run();
+        result_add(&r, delivered, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+        if (delivered != opt_items || wait_failures)
+            ++r.failures;
+    }
+    print_result(&r);
+}
+
+static void bench_pubsub(void)
+{
+    bench_pubsub_pass(PASS_NAMES);
+    bench_pubsub_pass(PASS_IDS);
+    bench_pubsub_pass(PASS_SPSC);
+    bench_pubsub_pass(PASS_BATCH);
+    bench_pubsub_pass(PASS_ZEROCOPY);
+    bench_payload_pass(false);
+    bench_payload_pass(true);
+    bench_pubsub_wait();
+    bench_pubsub_refuse();
+    bench_pubsub_wake();
+    if (!opt_csv)
+        printf("# pubsub: %u of %u bytes in use with one %u-message topic\n",
+               pubsub_memory_usage(&bench_mgr), (unsigned int)sizeof(bench_mgr),
+               (unsigned int)BENCH_DEPTH);
+}
+
+/* Dispatch cost should follow the topic's own fan-out, not the total
+ * number of subscribers in the manager */
+static void bench_dispatch(void)
+{
+    static const unsigned int totals[] = { 1, 8, 16, PUBSUB_MAX_SUBSCRIBERS };
+    static char names[sizeof(totals) / sizeof(totals[0])][16];
+    unsigned int k, round, i;
+    PubSubMessage msg;
+
+    for (k = 0; k < sizeof(totals) / sizeof(totals[0]); ++k) {
+        bench_result_t r;
+        int topic, other;
+
+        snprintf(names[k], sizeof(names[0]), "process/%usubs", totals[k]);
+        result_begin(&r, "pubsub", names[k]);
+
+        for (round = 0; round < opt_rounds; ++round) {
+            unsigned int sent = 0;
+
+            pubsub_init(&bench_mgr);
+            topic = bench_topic("bench", 0);
+            other = bench_topic("other", 0);
+            pubsub_subscribe_id(&bench_mgr, topic, bench_subscriber, NULL);
+            for (i = 1; i < totals[k]; ++i)
+                pubsub_subscribe_id(&bench_mgr, other, bench_subscriber, NULL);
+            delivered = 0;
+
+            while (sent < opt_items) {
+                unsigned int batch = 0;
+                unsigned long a0, f0;
+                double t0;
+
+                while (sent < opt_items) {
+                    msg.key = (int)sent;
+                    msg.value = NULL;
+                    if (!pubsub_publish_id(&bench_mgr, topic, &msg))
+                        break;
+                    ++sent;
+                    ++batch;
+                }
+                a0 = alloc_calls; f0 = free_calls;
+                t0 = now_seconds();
+                pubsub_process_id(&bench_mgr, topic);
+                result_add(&r, batch, now_seconds() - t0,
+                           alloc_calls - a0, free_calls - f0);
+                if (batch == 0) {
+                    ++r.failures;
+                    break;
+                }
+            }
+            if (delivered != sent)
+                ++r.failures;
+        }
+
+        print_result(&r);
+    }
+}
+
+/* process_all with one busy topic among PUBSUB_MAX_TOPICS: empty topics
+ * should cost a compare each, not a lock round trip */
+static void bench_dispatch_all(void)
+{
+    bench_result_t r;
+    PubSubTopicConfig config;
+    PubSubMessage msg;
+    char name[16];
+    unsigned int round, i;
+    int topic;
+
+    result_begin(&r, "pubsub", "process_all/1busy");
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned int sent = 0;
+
+        pubsub_init(&bench_mgr);
+        topic = bench_topic("bench", 0);
+        pubsub_subscribe_id(&bench_mgr, topic, bench_subscriber, NULL);
+        pubsub_topic_config_init(&config);
+        config.depth = 2;
+        for (i = 1; i < PUBSUB_MAX_TOPICS; ++i) {
+            snprintf(name, sizeof(name), "idle%u", i);
+            pubsub_create_topic_ex(&bench_mgr, name, &config);
+        }
+        delivered = 0;
+
+        while (sent < opt_items) {
+            unsigned int batch = 0;
+            unsigned long a0, f0;
+            double t0;
+
+            /* One message per pass: the empty topics dominate */
+            msg.key = (int)sent;
+            msg.value = NULL;
+            if (pubsub_publish_id(&bench_mgr, topic, &msg)) {
+                ++sent;
+                ++batch;
+            }
+            a0 = alloc_calls; f0 = free_calls;
+            t0 = now_seconds();
+            pubsub_process_all(&bench_mgr);
+            result_add(&r, batch, now_seconds() - t0,
+                       alloc_calls - a0, free_calls - f0);
+            if (batch == 0) {
+                ++r.failures;
+                break;
+            }
+        }
+        if (delivered != sent)
+            ++r.failures;
+    }
+    print_result(&r);
+}
+
+/* ========== Scheduler workload ========== */
+
+static unsigned int yields_per_task = 0;
+static unsigned long yields_done = 0;
+
+static void bench_yield_task(void *arg)
+{
+    unsigned int i;
+    (void)arg;
+    for (i = 0; i < yields_per_task; ++i) {
+        ++yields_done;
+        scheduler_yield();
+    }
+}
+
+static void bench_yield(void)
+{
+    bench_result_t r_yield;
+    unsigned int round, i;
+
+    result_begin(&r_yield, "sched", "yield");
+    yields_per_task = opt_items / (opt_tasks ? opt_tasks : 1u);
+
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned long a0, f0;
+        double t0;
+
+        scheduler_init();
+        for (i = 0; i < opt_tasks; ++i) {
+            if (scheduler_add(bench_yield_task, NULL) < 0) {
+                ++r_yield.failures;
+                break;
+            }
+        }
+        yields_done = 0;
+
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        scheduler_run();
+        result_add(&r_yield, yields_done, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        if (yields_done != (unsigned long)yields_per_task * opt_tasks)
+            ++r_yield.failures;
+    }
+
+    print_result(&r_yield);
+}
+
+/* Yield cost with sleeping tasks present: two tasks ping-pong while the
+ * rest sleep far in the future. With the ready queue the rate should not
+ * depend on the number of sleepers. */
+static int sleeper_ids[SCHED_MAX_TASKS];
+static unsigned int sleeper_count = 0;
+static unsigned char yielders_left = 0;
+
+static void bench_sleeper_task(void *arg)
+{
+    (void)arg;
+    for (;;)
+        scheduler_sleep(30000u);
+}
+
+static void bench_yielder_task(void *arg)
+{
+    unsigned int i;
+    (void)arg;
+    for (i = 0; i < yields_per_task; ++i) {
+        ++yields_done;
+        scheduler_yield();
+    }
+    /* the sleepers would outlive the run; retire them */
+    if (--yielders_left == 0) {
+        for (i = 0; i < sleeper_count; ++i) scheduler_remove(sleeper_ids[i]);
+    }
+}
+
+static void bench_sleepers(void)
+{
+    static char names[SCHED_MAX_TASKS][16];
+    unsigned int tasks, round, i;
+
+    yields_per_task = opt_items / 2u;
+
+    for (tasks = 4; tasks <= SCHED_MAX_TASKS; ++tasks) {
+        bench_result_t r;
+        unsigned int sleepers = tasks - 2u;
+
+        snprintf(names[tasks - 1], sizeof(names[0]), "yield/%usleep", sleepers);
+        result_begin(&r, "sched", names[tasks - 1]);
+
+        for (round = 0; round < opt_rounds; ++round) {
+            unsigned long a0, f0;
+            double t0;
+
+            scheduler_init();
+            yielders_left = 2;
+            sleeper_count = sleepers;
+            for (i = 0; i < sleepers; ++i) {
+                sleeper_ids[i] = scheduler_add(bench_sleeper_task, NULL);
+                if (sleeper_ids[i] < 0) ++r.failures;
+            }
+            for (i = 0; i < 2; ++i) {
+                if (scheduler_add(bench_yielder_task, NULL) < 0) ++r.failures;
+            }
+            yields_done = 0;
+
+            a0 = alloc_calls; f0 = free_calls;
+            t0 = now_seconds();
+            scheduler_run();
+            result_add(&r, yields_done, now_seconds() - t0,
+                       alloc_calls - a0, free_calls - f0);
+
+            if (yields_done != (unsigned long)yields_per_task * 2u)
+                ++r.failures;
+        }
+
+        print_result(&r);
+    }
+}
+
+/* ========== Mutex workload ========== */
+
+static scheduler_mutex_t bench_mutex;
+static unsigned long mutex_counter = 0;
+static unsigned int mutex_iters = 0;
+
+#if PUBSUB_LOCKING
+/* Contend on the real pubsub manager lock */
+#define BENCH_LOCK() pubsub_lock(&bench_mgr)
+#define BENCH_UNLOCK() pubsub_unlock(&bench_mgr)
+#else
+#define BENCH_LOCK() scheduler_mutex_lock(&bench_mutex)
+#define BENCH_UNLOCK() scheduler_mutex_unlock(&bench_mutex)
+#endif
+
+static void bench_mutex_task(void *arg)
+{
+    unsigned int i;
+    unsigned long v;
+    (void)arg;
+    for (i = 0; i < mutex_iters; ++i) {
+        BENCH_LOCK();
+        v = mutex_counter;
+        scheduler_yield(); /* every other task now finds the lock held */
+        mutex_counter = v + 1;
+        BENCH_UNLOCK();
+    }
+}
+
+static void bench_mutex_workload(void)
+{
+    bench_result_t r_fast, r_contended;
+    unsigned int round, i;
+    unsigned int tasks = opt_tasks ? opt_tasks : 1u;
+
+    result_begin(&r_fast, "mutex", "lock/unlock");
+    result_begin(&r_contended, "mutex", "contended");
+    mutex_iters = opt_items / tasks;
+
+    for (round = 0; round < opt_rounds; ++round) {
+        unsigned long a0, f0;
+        double t0;
+
+        /* Fast path: free lock, taken outside any task */
+        scheduler_init();
+        scheduler_mutex_init(&bench_mutex);
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        for (i = 0; i < opt_items; ++i) {
+            if (scheduler_mutex_lock(&bench_mutex) != 0) ++r_fast.failures;
+            scheduler_mutex_unlock(&bench_mutex);
+        }
+        result_add(&r_fast, opt_items, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        /* Every acquisition contended: the holder yields with the lock held */
+        scheduler_init();
+        pubsub_init(&bench_mgr);
+        mutex_counter = 0;
+        for (i = 0; i < tasks; ++i) {
+            if (scheduler_add(bench_mutex_task, NULL) < 0) {
+                ++r_contended.failures;
+                break;
+            }
+        }
+        a0 = alloc_calls; f0 = free_calls;
+        t0 = now_seconds();
+        scheduler_run();
+        result_add(&r_contended, mutex_counter, now_seconds() - t0,
+                   alloc_calls - a0, free_calls - f0);
+
+        if (mutex_counter != (unsigned long)mutex_iters * tasks)
+            ++r_contended.failures;
+    }
+
+    print_result(&r_fast);
+    print_result(&r_contended);
+}
+
+/* ========== Driver ========== */
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n items] [-r rounds] [-s seed] [-S subscribers] [-k tasks] [-q] [-c] "
+            "[btree|pubsub|dispatch|yield|sleepers|mutex]...\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int run_btree = 0, run_pubsub = 0, run_dispatch = 0, run_yield = 0, run_sleepers = 0;
+    int run_mutex = 0;
+    int any = 0;
+
+    for (i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        if (a[0] == '-' && a[1] && !a[2]) {
+            switch (a[1]) {
+            case 'q': opt_sequential = 1; continue;
+            case 'c': opt_csv = 1; continue;
+            case 'n': case 'r': case 's': case 'S': case 'k':
+                if (i + 1 >= argc) { usage(argv[0]); return 2; }
+                {
+                    unsigned int v = (unsigned int)strtoul(argv[++i], NULL, 0);
+                    if (a[1] == 'n') opt_items = v;
+                    else if (a[1] == 'r') opt_rounds = v ? v : 1u;
+                    else if (a[1] == 's') opt_seed = v;
+                    else if (a[1] == 'S') opt_subscribers = v;
+                    else opt_tasks = v;
+                }
+                continue;
+            default:
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        if (strcmp(a, "btree") == 0) run_btree = any = 1;
+        else if (strcmp(a, "pubsub") == 0) run_pubsub = any = 1;
+        else if (strcmp(a, "dispatch") == 0) run_dispatch = any = 1;
+        else if (strcmp(a, "yield") == 0) run_yield = any = 1;
+        else if (strcmp(a, "sleepers") == 0) run_sleepers = any = 1;
+        else if (strcmp(a, "mutex") == 0) run_mutex = any = 1;
+        else { usage(argv[0]); return 2; }
+    }
+    if (!any) run_btree = run_pubsub = run_dispatch = run_yield = run_sleepers = run_mutex = 1;
+    if (opt_tasks > SCHED_MAX_TASKS) opt_tasks = SCHED_MAX_TASKS;
+
+    random_seed = opt_seed ? opt_seed : 42u;
+
+    if (!opt_csv)
+        printf("# bench_host: items=%u rounds=%u seed=%u subscribers=%u tasks=%u%s\n",
+               opt_items, opt_rounds, opt_seed, opt_subscribers, opt_tasks,
+               opt_sequential ? " sequential" : "");
+    print_header();
+
+    if (run_btree) {
+        bench_btree();
+        bench_btree_churn(0);
+        bench_btree_churn(1);
+    }
+    if (run_pubsub) bench_pubsub();
+    if (run_dispatch) {
+        bench_dispatch();
+        bench_dispatch_all();
+    }
+    if (run_yield) bench_yield();
+    if (run_sleepers) bench_sleepers();
+    if (run_mutex) bench_mutex_workload();
+
+    return total_failures ? 1 : 0;
+}
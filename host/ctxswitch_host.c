@@ -0,0 +1,81 @@
+/* ctxswitch_host.c - ucontext-based stand-in for ctxswitch.s on the host
+ *
+ * Provides ctx_switch() for host-native builds of scheduler.c. Instead of
+ * copying page 1 into task_t.stack[], every task (and the scheduler/main
+ * context) owns a ucontext_t with its own native stack, looked up by the
+ * task_t pointer held in ctx_cur/ctx_next.
+ *
+ * Unlike the 6502 build, scheduler_run() returns here once no runnable task
+ * is left, so host benchmarks can run the scheduler more than once.
+ */
+#define _XOPEN_SOURCE 700
+#include <ucontext.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "scheduler_task.h"
+
+#ifndef HOST_TASK_STACK_SIZE
+#define HOST_TASK_STACK_SIZE (64u * 1024u)
+#endif
+
+typedef struct {
+    void *task;             /* task_t this context belongs to */
+    ucontext_t uc;
+    unsigned char *stack;   /* native stack, NULL for the main context */
+} host_ctx_t;
+
+/* One slot per task plus the scheduler/main context */
+static host_ctx_t host_ctx[SCHED_MAX_TASKS + 1];
+static host_ctx_t *host_main = 0;
+
+static host_ctx_t *host_ctx_for(void *task)
+{
+    unsigned int i;
+    for (i = 0; i < SCHED_MAX_TASKS + 1; ++i) {
+        if (host_ctx[i].task == task) return &host_ctx[i];
+    }
+    for (i = 0; i < SCHED_MAX_TASKS + 1; ++i) {
+        if (!host_ctx[i].task) {
+            host_ctx[i].task = task;
+            return &host_ctx[i];
+        }
+    }
+    fprintf(stderr, "ctxswitch_host: out of contexts\n");
+    abort();
+    return 0;
+}
+
+static void host_trampoline(void)
+{
+    /* Same job as start_trampoline in ctxswitch.s */
+    scheduler_start_task();
+    /* scheduler_start_task only returns when nothing is left to run */
+    setcontext(&host_main->uc);
+}
+
+void ctx_switch(void)
+{
+    task_t *next = (task_t *)ctx_next;
+    host_ctx_t *from = host_ctx_for(ctx_cur);
+    host_ctx_t *to = host_ctx_for(ctx_next);
+
+    /* The first switch always comes from scheduler_run() */
+    if (!host_main) host_main = from;
+
+    if (!next->started) {
+        next->started = 1;
+        if (!to->stack) {
+            to->stack = (unsigned char *)malloc(HOST_TASK_STACK_SIZE);
+            if (!to->stack) {
+                fprintf(stderr, "ctxswitch_host: no memory for task stack\n");
+                abort();
+            }
+        }
+        getcontext(&to->uc);
+        to->uc.uc_stack.ss_sp = to->stack;
+        to->uc.uc_stack.ss_size = HOST_TASK_STACK_SIZE;
+        to->uc.uc_link = 0;
+        makecontext(&to->uc, host_trampoline, 0);
+    }
+    swapcontext(&from->uc, &to->uc);
+}
@@ -2,25 +2,93 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-static BTreeNode *node_create(unsigned char is_leaf)
+/* Leaf values and internal children share storage in a B+ tree; go
+ * through these so the pool, the whole-tree walks and the code that only
+ * touches one kind of node read the same in both modes */
+#if BTREE_BPLUS
+#define NODE_CHILDREN(n) ((n)->u.children)
+#define NODE_VALUES(n) ((n)->u.leaf.values)
+#else
+#define NODE_CHILDREN(n) ((n)->children)
+#define NODE_VALUES(n) ((n)->values)
+#endif
+
+#if BTREE_POOL_NODES > 0
+static BTreeNode default_arena[BTREE_POOL_NODES];
+BTreePool btree_default_pool;
+#endif
+
+/* Explicit path for whole-tree walks (count, free) instead of recursion:
+ * on cc65 every recursive level costs a C stack frame in the calling
+ * task plus a return address on page 1. Tree operations never yield, so
+ * one static path serves all tasks. */
+static BTreeNode *walk_path[BTREE_MAX_DEPTH];
+static unsigned char walk_index[BTREE_MAX_DEPTH];
+
+void btree_pool_init(BTreePool *pool, BTreeNode *arena, unsigned int capacity)
+{
+    if (!pool)
+        return;
+
+    pool->nodes = arena;
+    pool->free_list = NULL;
+    pool->capacity = arena ? capacity : 0;
+    pool->next_unused = 0;
+    pool->in_use = 0;
+    pool->high_water = 0;
+    pool->failures = 0;
+}
+
+static BTreeNode *node_create(BTreePool *pool, unsigned char is_leaf)
 {
     BTreeNode *node;
     unsigned char i;
 
-    node = (BTreeNode *)malloc(sizeof(BTreeNode));
+    if (!pool)
+        node = (BTreeNode *)malloc(sizeof(BTreeNode));
+    else if (pool->free_list)
+    {
+        node = pool->free_list;
+        pool->free_list = NODE_CHILDREN(node)[0];
+    }
+    else if (pool->next_unused < pool->capacity)
+        node = &pool->nodes[pool->next_unused++];
+    else
+        node = NULL;
+
     if (!node)
+    {
+        if (pool)
+            pool->failures++;
         return NULL;
+    }
+
+    if (pool && ++pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
 
     node->key_count = 0;
     node->is_leaf = is_leaf;
 
     for (i = 0; i < BTREE_MAX_CHILDREN; i++)
-        node->children[i] = NULL;
+        NODE_CHILDREN(node)[i] = NULL;
 
     return node;
 }
 
-BTree *btree_create(void)
+static void node_free(BTreePool *pool, BTreeNode *node)
+{
+    if (!pool)
+    {
+        free(node);
+        return;
+    }
+
+    NODE_CHILDREN(node)[0] = pool->free_list;
+    pool->free_list = node;
+    pool->in_use--;
+}
+
+BTree *btree_create_in_pool(BTreePool *pool)
 {
     BTree *tree;
 
@@ -28,7 +96,8 @@ BTree *btree_create(void)
     if (!tree)
         return NULL;
 
-    tree->root = node_create(1);
+    tree->pool = pool;
+    tree->root = node_create(pool, 1);
     if (!tree->root)
     {
         free(tree);
@@ -38,7 +107,160 @@ BTree *btree_create(void)
     return tree;
 }
 
-static void node_split_child(BTreeNode *parent, unsigned char index)
+BTree *btree_create(void)
+{
+#if BTREE_POOL_NODES > 0
+    if (!btree_default_pool.nodes)
+        btree_pool_init(&btree_default_pool, default_arena, BTREE_POOL_NODES);
+    return btree_create_in_pool(&btree_default_pool);
+#else
+    return btree_create_in_pool(NULL);
+#endif
+}
+
+/* Index of the first key >= key, or key_count if there is none */
+static unsigned char node_find(const BTreeNode *node, unsigned int key)
+{
+#if BTREE_BINARY_SEARCH
+    unsigned char lo = 0;
+    unsigned char hi = node->key_count;
+    unsigned char mid;
+
+    while (lo < hi)
+    {
+        mid = (unsigned char)((lo + hi) >> 1);
+        if (node->keys[mid] < key)
+            lo = (unsigned char)(mid + 1);
+        else
+            hi = mid;
+    }
+    return lo;
+#else
+    unsigned char i = 0;
+
+    while (i < node->key_count && key > node->keys[i])
+        i++;
+    return i;
+#endif
+}
+
+#if BTREE_BPLUS
+/* Returns 0 if the new node could not be allocated. A leaf splits evenly
+ * and copies the right half's first key up as the separator; an internal
+ * node moves its median up, as in the plain B-tree. */
+static unsigned char node_split_child(BTreePool *pool, BTreeNode *parent, unsigned char index)
+{
+    BTreeNode *full_child;
+    BTreeNode *new_node;
+    unsigned char i;
+    unsigned char keep;
+    unsigned int separator;
+
+    full_child = NODE_CHILDREN(parent)[index];
+    new_node = node_create(pool, full_child->is_leaf);
+
+    if (!new_node)
+        return 0;
+
+    if (full_child->is_leaf)
+    {
+        keep = (unsigned char)(BTREE_MAX_KEYS - BTREE_LEAF_MIN_KEYS);
+        for (i = 0; i < BTREE_LEAF_MIN_KEYS; i++)
+        {
+            new_node->keys[i] = full_child->keys[keep + i];
+            NODE_VALUES(new_node)[i] = NODE_VALUES(full_child)[keep + i];
+        }
+        new_node->key_count = BTREE_LEAF_MIN_KEYS;
+
+        /* Link the new leaf in after the old one */
+        new_node->u.leaf.next = full_child->u.leaf.next;
+        full_child->u.leaf.next = new_node;
+        separator = new_node->keys[0];
+    }
+    else
+    {
+        keep = BTREE_SPLIT_INDEX;
+        for (i = 0; i < BTREE_MAX_KEYS - keep - 1; i++)
+            new_node->keys[i] = full_child->keys[keep + 1 + i];
+        for (i = 0; i < BTREE_MAX_CHILDREN - keep - 1; i++)
+            NODE_CHILDREN(new_node)[i] = NODE_CHILDREN(full_child)[keep + 1 + i];
+        new_node->key_count = (unsigned char)(BTREE_MAX_KEYS - keep - 1);
+        separator = full_child->keys[keep];
+    }
+
+    full_child->key_count = keep;
+
+    /* Shift parent keys/children to make room */
+    for (i = parent->key_count + 1; i > index + 1; i--)
+        NODE_CHILDREN(parent)[i] = NODE_CHILDREN(parent)[i - 1];
+    for (i = parent->key_count; i > index; i--)
+        parent->keys[i] = parent->keys[i - 1];
+
+    parent->keys[index] = separator;
+    NODE_CHILDREN(parent)[index + 1] = new_node;
+    parent->key_count++;
+    return 1;
+}
+
+/* Child of an internal node whose subtree holds key: keys equal to a
+ * separator live to its right */
+static unsigned char child_find(const BTreeNode *node, unsigned int key)
+{
+    unsigned char i;
+
+    i = node_find(node, key);
+    if (i < node->key_count && key == node->keys[i])
+        i++;
+    return i;
+}
+
+static unsigned char btree_insert_non_full(BTreePool *pool, BTreeNode *node,
+                                           unsigned int key, void *value)
+{
+    unsigned char i;
+    unsigned char j;
+
+    while (!node->is_leaf)
+    {
+        i = child_find(node, key);
+
+        /* Split child if full, so the descent never has to back up */
+        if (NODE_CHILDREN(node)[i]->key_count == BTREE_MAX_KEYS)
+        {
+            if (!node_split_child(pool, node, i))
+                return 0;
+            if (key >= node->keys[i])
+                i++;
+        }
+
+        node = NODE_CHILDREN(node)[i];
+    }
+
+    i = node_find(node, key);
+
+    /* Check for duplicate */
+    if (i < node->key_count && key == node->keys[i])
+    {
+        NODE_VALUES(node)[i] = value;
+        return 1;
+    }
+
+    /* Insert key in sorted position */
+    for (j = node->key_count; j > i; j--)
+    {
+        node->keys[j] = node->keys[j - 1];
+        NODE_VALUES(node)[j] = NODE_VALUES(node)[j - 1];
+    }
+
+    node->keys[i] = key;
+    NODE_VALUES(node)[i] = value;
+    node->key_count++;
+    return 1;
+}
+
+#else
+/* Returns 0 if the new node could not be allocated */
+static unsigned char node_split_child(BTreePool *pool, BTreeNode *parent, unsigned char index)
 {
     BTreeNode *full_child;
     BTreeNode *new_node;
@@ -47,11 +269,11 @@ static void node_split_child(BTreeNode *parent, unsigned char index)
     unsigned char move_children;
     unsigned char mid;
 
-    full_child = parent->children[index];
-    new_node = node_create(full_child->is_leaf);
+    full_child = NODE_CHILDREN(parent)[index];
+    new_node = node_create(pool, full_child->is_leaf);
 
     if (!new_node)
-        return;
+        return 0;
     mid = BTREE_SPLIT_INDEX;
     move_keys = (unsigned char)(BTREE_MAX_KEYS - mid - 1);
     move_children = (unsigned char)(BTREE_MAX_CHILDREN - mid - 1);
@@ -60,7 +282,7 @@ static void node_split_child(BTreeNode *parent, unsigned char index)
     for (i = 0; i < move_keys; i++)
     {
         new_node->keys[i] = full_child->keys[mid + 1 + i];
-        new_node->values[i] = full_child->values[mid + 1 + i];
+        NODE_VALUES(new_node)[i] = NODE_VALUES(full_child)[mid + 1 + i];
     }
     new_node->key_count = move_keys;
 
@@ -68,7 +290,7 @@ static void node_split_child(BTreeNode *parent, unsigned char index)
     if (!full_child->is_leaf)
     {
         for (i = 0; i < move_children; i++)
-            new_node->children[i] = full_child->children[mid + 1 + i];
+            NODE_CHILDREN(new_node)[i] = NODE_CHILDREN(full_child)[mid + 1 + i];
     }
 
     /* Shrink full child */
@@ -76,130 +298,173 @@ static void node_split_child(BTreeNode *parent, unsigned char index)
 
     /* Shift parent children to make room */
     for (i = parent->key_count + 1; i > index + 1; i--)
-        parent->children[i] = parent->children[i - 1];
+        NODE_CHILDREN(parent)[i] = NODE_CHILDREN(parent)[i - 1];
 
     /* Shift parent keys/values */
     for (i = parent->key_count; i > index; i--)
     {
         parent->keys[i] = parent->keys[i - 1];
-        parent->values[i] = parent->values[i - 1];
+        NODE_VALUES(parent)[i] = NODE_VALUES(parent)[i - 1];
     }
 
     /* Promote middle key to parent */
     parent->keys[index] = full_child->keys[mid];
-    parent->values[index] = full_child->values[mid];
-    parent->children[index + 1] = new_node;
+    NODE_VALUES(parent)[index] = NODE_VALUES(full_child)[mid];
+    NODE_CHILDREN(parent)[index + 1] = new_node;
     parent->key_count++;
+    return 1;
 }
 
-static void btree_insert_non_full(BTreeNode *node, unsigned int key, void *value)
+static unsigned char btree_insert_non_full(BTreePool *pool, BTreeNode *node,
+                                           unsigned int key, void *value)
 {
-    int i;
-
-    i = node->key_count - 1;
-
-    if (node->is_leaf)
-    {
-        /* Insert key in sorted position */
-        while (i >= 0 && key < node->keys[i])
-        {
-            node->keys[i + 1] = node->keys[i];
-            node->values[i + 1] = node->values[i];
-            i--;
-        }
-
-        /* Check for duplicate */
-        if (i >= 0 && key == node->keys[i])
-        {
-            node->values[i] = value;
-            return;
-        }
+    unsigned char i;
+    unsigned char j;
 
-        node->keys[i + 1] = key;
-        node->values[i + 1] = value;
-        node->key_count++;
-    }
-    else
+    for (;;)
     {
-        /* Find child to insert into */
-        while (i >= 0 && key < node->keys[i])
-            i--;
+        i = node_find(node, key);
 
         /* Check for duplicate */
-        if (i >= 0 && key == node->keys[i])
+        if (i < node->key_count && key == node->keys[i])
         {
-            node->values[i] = value;
-            return;
+            NODE_VALUES(node)[i] = value;
+            return 1;
         }
 
-        i++;
+        if (node->is_leaf)
+            break;
 
-        /* Split child if full */
-        if (node->children[i]->key_count == BTREE_MAX_KEYS)
+        /* Split child if full, so the descent never has to back up */
+        if (NODE_CHILDREN(node)[i]->key_count == BTREE_MAX_KEYS)
         {
-            node_split_child(node, i);
+            if (!node_split_child(pool, node, i))
+                return 0;
 
+            /* The promoted median may be the key itself */
+            if (key == node->keys[i])
+            {
+                NODE_VALUES(node)[i] = value;
+                return 1;
+            }
             if (key > node->keys[i])
                 i++;
         }
 
-        btree_insert_non_full(node->children[i], key, value);
+        node = NODE_CHILDREN(node)[i];
     }
+
+    /* Insert key in sorted position */
+    for (j = node->key_count; j > i; j--)
+    {
+        node->keys[j] = node->keys[j - 1];
+        NODE_VALUES(node)[j] = NODE_VALUES(node)[j - 1];
+    }
+
+    node->keys[i] = key;
+    NODE_VALUES(node)[i] = value;
+    node->key_count++;
+    return 1;
 }
 
-void btree_insert(BTree *tree, unsigned int key, void *value)
+#endif
+
+unsigned char btree_insert(BTree *tree, unsigned int key, void *value)
 {
     BTreeNode *new_root;
 
     if (!tree || !tree->root)
-        return;
+        return 0;
 
     if (tree->root->key_count == BTREE_MAX_KEYS)
     {
         /* Root is full, split it */
-        new_root = node_create(0);
+        new_root = node_create(tree->pool, 0);
         if (!new_root)
-            return;
+            return 0;
 
-        new_root->children[0] = tree->root;
-        node_split_child(new_root, 0);
+        NODE_CHILDREN(new_root)[0] = tree->root;
+        if (!node_split_child(tree->pool, new_root, 0))
+        {
+            node_free(tree->pool, new_root);
+            return 0;
+        }
         tree->root = new_root;
     }
 
-    btree_insert_non_full(tree->root, key, value);
+    return btree_insert_non_full(tree->pool, tree->root, key, value);
+}
+
+#if BTREE_BPLUS
+/* Leaf whose range holds key */
+static BTreeNode *leaf_find(BTreeNode *node, unsigned int key)
+{
+    while (!node->is_leaf)
+        node = NODE_CHILDREN(node)[child_find(node, key)];
+    return node;
 }
 
 static void *btree_search_node(BTreeNode *node, unsigned int key)
 {
     unsigned char i;
 
-    i = 0;
-    while (i < node->key_count && key > node->keys[i])
-        i++;
+    node = leaf_find(node, key);
+    i = node_find(node, key);
 
     if (i < node->key_count && key == node->keys[i])
-        return node->values[i];
+        return NODE_VALUES(node)[i];
 
-    if (node->is_leaf)
-        return NULL; /* Not found */
+    return NULL; /* Not found */
+}
+
+#else
+static void *btree_search_node(BTreeNode *node, unsigned int key)
+{
+    unsigned char i;
+
+    for (;;)
+    {
+        i = node_find(node, key);
 
-    return btree_search_node(node->children[i], key);
+        if (i < node->key_count && key == node->keys[i])
+            return NODE_VALUES(node)[i];
+
+        if (node->is_leaf)
+            return NULL; /* Not found */
+
+        node = NODE_CHILDREN(node)[i];
+    }
 }
 
+#endif
+
 static unsigned int btree_count_nodes_internal(BTreeNode *node)
 {
     unsigned int count;
-    unsigned char i;
+    unsigned char depth;
 
     if (!node)
         return 0;
 
     count = 1;
+    depth = 0;
+    walk_path[0] = node;
+    walk_index[0] = 0;
 
-    if (!node->is_leaf)
+    for (;;)
     {
-        for (i = 0; i <= node->key_count; i++)
-            count = (unsigned int)(count + btree_count_nodes_internal(node->children[i]));
+        node = walk_path[depth];
+        if (!node->is_leaf && walk_index[depth] <= node->key_count)
+        {
+            /* Descend into the next child */
+            walk_path[depth + 1] = NODE_CHILDREN(node)[walk_index[depth]++];
+            walk_index[++depth] = 0;
+            count++;
+        }
+        else if (depth == 0)
+            break;
+        else
+            depth--;
     }
 
     return count;
@@ -221,6 +486,28 @@ unsigned int btree_node_count(BTree *tree)
     return btree_count_nodes_internal(tree->root);
 }
 
+#if BTREE_BPLUS
+unsigned char btree_update(BTree *tree, unsigned int key, void *new_value)
+{
+    BTreeNode *node;
+    unsigned char i;
+
+    if (!tree || !tree->root)
+        return 0;
+
+    node = leaf_find(tree->root, key);
+    i = node_find(node, key);
+
+    if (i < node->key_count && key == node->keys[i])
+    {
+        NODE_VALUES(node)[i] = new_value;
+        return 1;
+    }
+
+    return 0;
+}
+
+#else
 unsigned char btree_update(BTree *tree, unsigned int key, void *new_value)
 {
     BTreeNode *node;
@@ -233,193 +520,366 @@ unsigned char btree_update(BTree *tree, unsigned int key, void *new_value)
 
     while (node)
     {
-        i = 0;
-        while (i < node->key_count && key > node->keys[i])
-            i++;
+        i = node_find(node, key);
 
         if (i < node->key_count && key == node->keys[i])
         {
-            node->values[i] = new_value;
+            NODE_VALUES(node)[i] = new_value;
             return 1;
         }
 
         if (node->is_leaf)
             return 0;
 
-        node = node->children[i];
+        node = NODE_CHILDREN(node)[i];
     }
 
     return 0;
 }
 
-static void merge_nodes(BTreeNode *parent, unsigned char index)
+#endif
+
+#if BTREE_BPLUS
+static void merge_nodes(BTreePool *pool, BTreeNode *parent, unsigned char index)
 {
     BTreeNode *left;
     BTreeNode *right;
     unsigned char i;
 
-    left = parent->children[index];
-    right = parent->children[index + 1];
+    left = NODE_CHILDREN(parent)[index];
+    right = NODE_CHILDREN(parent)[index + 1];
 
-    /* Bring parent separator down */
-    left->keys[left->key_count] = parent->keys[index];
-    left->values[left->key_count] = parent->values[index];
-
-    /* Append right node keys */
-    for (i = 0; i < right->key_count; i++)
+    if (left->is_leaf)
     {
-        left->keys[left->key_count + 1 + i] = right->keys[i];
-        left->values[left->key_count + 1 + i] = right->values[i];
+        /* Leaves just concatenate: the separator was only a copy */
+        for (i = 0; i < right->key_count; i++)
+        {
+            left->keys[left->key_count + i] = right->keys[i];
+            NODE_VALUES(left)[left->key_count + i] = NODE_VALUES(right)[i];
+        }
+        left->key_count = (unsigned char)(left->key_count + right->key_count);
+        left->u.leaf.next = right->u.leaf.next;
     }
-
-    /* Append right children if internal */
-    if (!left->is_leaf)
+    else
     {
+        /* Bring parent separator down, then append the right node */
+        left->keys[left->key_count] = parent->keys[index];
+        for (i = 0; i < right->key_count; i++)
+            left->keys[left->key_count + 1 + i] = right->keys[i];
         for (i = 0; i <= right->key_count; i++)
-            left->children[left->key_count + 1 + i] = right->children[i];
+            NODE_CHILDREN(left)[left->key_count + 1 + i] = NODE_CHILDREN(right)[i];
+        left->key_count = (unsigned char)(left->key_count + 1 + right->key_count);
     }
 
-    left->key_count = (unsigned char)(left->key_count + 1 + right->key_count);
-
     /* Shift parent keys/children to close gap */
     for (i = index; i < parent->key_count - 1; i++)
     {
         parent->keys[i] = parent->keys[i + 1];
-        parent->values[i] = parent->values[i + 1];
-        parent->children[i + 1] = parent->children[i + 2];
+        NODE_CHILDREN(parent)[i + 1] = NODE_CHILDREN(parent)[i + 2];
     }
 
     parent->key_count--;
-    free(right);
+    node_free(pool, right);
 }
 
-static void btree_delete_node(BTreeNode *node, unsigned int key)
+/* Move the last entry of children[i - 1] to the front of children[i] */
+static void borrow_left(BTreeNode *node, unsigned char i)
 {
-    unsigned char i;
     BTreeNode *child;
     BTreeNode *left;
+    unsigned char j;
+
+    child = NODE_CHILDREN(node)[i];
+    left = NODE_CHILDREN(node)[i - 1];
+
+    for (j = child->key_count; j > 0; j--)
+        child->keys[j] = child->keys[j - 1];
+
+    if (child->is_leaf)
+    {
+        for (j = child->key_count; j > 0; j--)
+            NODE_VALUES(child)[j] = NODE_VALUES(child)[j - 1];
+        child->keys[0] = left->keys[left->key_count - 1];
+        NODE_VALUES(child)[0] = NODE_VALUES(left)[left->key_count - 1];
+        node->keys[i - 1] = child->keys[0];
+    }
+    else
+    {
+        for (j = child->key_count + 1; j > 0; j--)
+            NODE_CHILDREN(child)[j] = NODE_CHILDREN(child)[j - 1];
+        child->keys[0] = node->keys[i - 1];
+        NODE_CHILDREN(child)[0] = NODE_CHILDREN(left)[left->key_count];
+        node->keys[i - 1] = left->keys[left->key_count - 1];
+    }
+
+    left->key_count--;
+    child->key_count++;
+}
+
+/* Move the first entry of children[i + 1] to the end of children[i] */
+static void borrow_right(BTreeNode *node, unsigned char i)
+{
+    BTreeNode *child;
     BTreeNode *right;
     unsigned char j;
 
-    i = 0;
-    while (i < node->key_count && key > node->keys[i])
-        i++;
+    child = NODE_CHILDREN(node)[i];
+    right = NODE_CHILDREN(node)[i + 1];
 
-    if (i < node->key_count && key == node->keys[i])
+    if (child->is_leaf)
     {
-        if (node->is_leaf)
+        child->keys[child->key_count] = right->keys[0];
+        NODE_VALUES(child)[child->key_count] = NODE_VALUES(right)[0];
+        for (j = 0; j < right->key_count - 1; j++)
         {
-            /* Simple case: key is in leaf */
-            while (i < node->key_count - 1)
-            {
-                node->keys[i] = node->keys[i + 1];
-                node->values[i] = node->values[i + 1];
-                i++;
-            }
-            node->key_count--;
+            right->keys[j] = right->keys[j + 1];
+            NODE_VALUES(right)[j] = NODE_VALUES(right)[j + 1];
         }
-        else
-        {
-            /* Internal node: choose predecessor or successor; otherwise merge */
-            left = node->children[i];
-            right = node->children[i + 1];
+        node->keys[i] = right->keys[0];
+    }
+    else
+    {
+        child->keys[child->key_count] = node->keys[i];
+        NODE_CHILDREN(child)[child->key_count + 1] = NODE_CHILDREN(right)[0];
+        node->keys[i] = right->keys[0];
+        for (j = 0; j < right->key_count - 1; j++)
+            right->keys[j] = right->keys[j + 1];
+        for (j = 0; j < right->key_count; j++)
+            NODE_CHILDREN(right)[j] = NODE_CHILDREN(right)[j + 1];
+    }
 
-            if (left->key_count > BTREE_MIN_KEYS)
-            {
-                node->keys[i] = left->keys[left->key_count - 1];
-                node->values[i] = left->values[left->key_count - 1];
-                btree_delete_node(left, node->keys[i]);
-            }
-            else if (right->key_count > BTREE_MIN_KEYS)
-            {
-                node->keys[i] = right->keys[0];
-                node->values[i] = right->values[0];
-                btree_delete_node(right, node->keys[i]);
-            }
+    right->key_count--;
+    child->key_count++;
+}
+
+#define node_min_keys(node) ((node)->is_leaf ? BTREE_LEAF_MIN_KEYS : BTREE_MIN_KEYS)
+
+static void btree_delete_node(BTreePool *pool, BTreeNode *node, unsigned int key)
+{
+    unsigned char i;
+
+    /* Top up each child to above its minimum before entering it, so the
+     * leaf can lose an entry without rebalancing back up the path */
+    while (!node->is_leaf)
+    {
+        i = child_find(node, key);
+
+        if (NODE_CHILDREN(node)[i]->key_count <= node_min_keys(NODE_CHILDREN(node)[i]))
+        {
+            if (i > 0 && NODE_CHILDREN(node)[i - 1]->key_count > node_min_keys(NODE_CHILDREN(node)[i - 1]))
+                borrow_left(node, i);
+            else if (i < node->key_count &&
+                     NODE_CHILDREN(node)[i + 1]->key_count > node_min_keys(NODE_CHILDREN(node)[i + 1]))
+                borrow_right(node, i);
             else
             {
-                merge_nodes(node, i);
-                btree_delete_node(left, key);
+                if (i == node->key_count)
+                    i--;
+                merge_nodes(pool, node, i);
             }
         }
+
+        node = NODE_CHILDREN(node)[i];
     }
-    else if (!node->is_leaf)
-    {
-        child = node->children[i];
 
-        if (child->key_count == BTREE_MIN_KEYS)
+    i = node_find(node, key);
+    if (i < node->key_count && key == node->keys[i])
+    {
+        for (; i < node->key_count - 1; i++)
         {
-            if (i > 0 && node->children[i - 1]->key_count > BTREE_MIN_KEYS)
-            {
-                /* Borrow from left sibling */
-                left = node->children[i - 1];
+            node->keys[i] = node->keys[i + 1];
+            NODE_VALUES(node)[i] = NODE_VALUES(node)[i + 1];
+        }
+        node->key_count--;
+    }
+}
 
-                for (j = child->key_count; j > 0; j--)
-                {
-                    child->keys[j] = child->keys[j - 1];
-                    child->values[j] = child->values[j - 1];
-                }
-                if (!child->is_leaf)
-                    for (j = child->key_count + 1; j > 0; j--)
-                        child->children[j] = child->children[j - 1];
+#else
+static void merge_nodes(BTreePool *pool, BTreeNode *parent, unsigned char index)
+{
+    BTreeNode *left;
+    BTreeNode *right;
+    unsigned char i;
 
-                child->keys[0] = node->keys[i - 1];
-                child->values[0] = node->values[i - 1];
-                if (!child->is_leaf)
-                    child->children[0] = left->children[left->key_count];
+    left = NODE_CHILDREN(parent)[index];
+    right = NODE_CHILDREN(parent)[index + 1];
 
-                node->keys[i - 1] = left->keys[left->key_count - 1];
-                node->values[i - 1] = left->values[left->key_count - 1];
+    /* Bring parent separator down */
+    left->keys[left->key_count] = parent->keys[index];
+    NODE_VALUES(left)[left->key_count] = NODE_VALUES(parent)[index];
 
-                left->key_count--;
-                child->key_count++;
-            }
-            else if (i < node->key_count && node->children[i + 1]->key_count > BTREE_MIN_KEYS)
-            {
-                /* Borrow from right sibling */
-                right = node->children[i + 1];
+    /* Append right node keys */
+    for (i = 0; i < right->key_count; i++)
+    {
+        left->keys[left->key_count + 1 + i] = right->keys[i];
+        NODE_VALUES(left)[left->key_count + 1 + i] = NODE_VALUES(right)[i];
+    }
+
+    /* Append right children if internal */
+    if (!left->is_leaf)
+    {
+        for (i = 0; i <= right->key_count; i++)
+            NODE_CHILDREN(left)[left->key_count + 1 + i] = NODE_CHILDREN(right)[i];
+    }
+
+    left->key_count = (unsigned char)(left->key_count + 1 + right->key_count);
+
+    /* Shift parent keys/children to close gap */
+    for (i = index; i < parent->key_count - 1; i++)
+    {
+        parent->keys[i] = parent->keys[i + 1];
+        NODE_VALUES(parent)[i] = NODE_VALUES(parent)[i + 1];
+        NODE_CHILDREN(parent)[i + 1] = NODE_CHILDREN(parent)[i + 2];
+    }
+
+    parent->key_count--;
+    node_free(pool, right);
+}
 
-                child->keys[child->key_count] = node->keys[i];
-                child->values[child->key_count] = node->values[i];
-                if (!child->is_leaf)
-                    child->children[child->key_count + 1] = right->children[0];
+static void btree_delete_node(BTreePool *pool, BTreeNode *node, unsigned int key)
+{
+    unsigned char i;
+    BTreeNode *child;
+    BTreeNode *left;
+    BTreeNode *right;
+    BTreeNode *pred;
+    unsigned char j;
 
-                node->keys[i] = right->keys[0];
-                node->values[i] = right->values[0];
+    for (;;)
+    {
+        i = node_find(node, key);
 
-                for (j = 0; j < right->key_count - 1; j++)
+        if (i < node->key_count && key == node->keys[i])
+        {
+            if (node->is_leaf)
+            {
+                /* Simple case: key is in leaf */
+                while (i < node->key_count - 1)
                 {
-                    right->keys[j] = right->keys[j + 1];
-                    right->values[j] = right->values[j + 1];
+                    node->keys[i] = node->keys[i + 1];
+                    NODE_VALUES(node)[i] = NODE_VALUES(node)[i + 1];
+                    i++;
                 }
-                if (!right->is_leaf)
-                    for (j = 0; j <= right->key_count - 1; j++)
-                        right->children[j] = right->children[j + 1];
-
-                right->key_count--;
-                child->key_count++;
+                node->key_count--;
+                return;
             }
             else
             {
-                /* Merge with sibling */
-                if (i < node->key_count)
+                /* Internal node: choose predecessor or successor; otherwise merge */
+                left = NODE_CHILDREN(node)[i];
+                right = NODE_CHILDREN(node)[i + 1];
+
+                if (left->key_count > BTREE_MIN_KEYS)
+                {
+                    /* Predecessor is the rightmost key of the left subtree */
+                    pred = left;
+                    while (!pred->is_leaf)
+                        pred = NODE_CHILDREN(pred)[pred->key_count];
+                    node->keys[i] = pred->keys[pred->key_count - 1];
+                    NODE_VALUES(node)[i] = NODE_VALUES(pred)[pred->key_count - 1];
+                    key = node->keys[i];
+                    node = left;
+                }
+                else if (right->key_count > BTREE_MIN_KEYS)
                 {
-                    merge_nodes(node, i);
+                    /* Successor is the leftmost key of the right subtree */
+                    pred = right;
+                    while (!pred->is_leaf)
+                        pred = NODE_CHILDREN(pred)[0];
+                    node->keys[i] = pred->keys[0];
+                    NODE_VALUES(node)[i] = NODE_VALUES(pred)[0];
+                    key = node->keys[i];
+                    node = right;
                 }
                 else
                 {
-                    merge_nodes(node, (unsigned char)(i - 1));
-                    i = (unsigned char)(i - 1);
+                    merge_nodes(pool, node, i);
+                    node = left;
                 }
-
-                child = node->children[i];
             }
         }
+        else if (!node->is_leaf)
+        {
+            child = NODE_CHILDREN(node)[i];
+
+            if (child->key_count == BTREE_MIN_KEYS)
+            {
+                if (i > 0 && NODE_CHILDREN(node)[i - 1]->key_count > BTREE_MIN_KEYS)
+                {
+                    /* Borrow from left sibling */
+                    left = NODE_CHILDREN(node)[i - 1];
+
+                    for (j = child->key_count; j > 0; j--)
+                    {
+                        child->keys[j] = child->keys[j - 1];
+                        NODE_VALUES(child)[j] = NODE_VALUES(child)[j - 1];
+                    }
+                    if (!child->is_leaf)
+                        for (j = child->key_count + 1; j > 0; j--)
+                            NODE_CHILDREN(child)[j] = NODE_CHILDREN(child)[j - 1];
+
+                    child->keys[0] = node->keys[i - 1];
+                    NODE_VALUES(child)[0] = NODE_VALUES(node)[i - 1];
+                    if (!child->is_leaf)
+                        NODE_CHILDREN(child)[0] = NODE_CHILDREN(left)[left->key_count];
+
+                    node->keys[i - 1] = left->keys[left->key_count - 1];
+                    NODE_VALUES(node)[i - 1] = NODE_VALUES(left)[left->key_count - 1];
+
+                    left->key_count--;
+                    child->key_count++;
+                }
+                else if (i < node->key_count && NODE_CHILDREN(node)[i + 1]->key_count > BTREE_MIN_KEYS)
+                {
+                    /* Borrow from right sibling */
+                    right = NODE_CHILDREN(node)[i + 1];
+
+                    child->keys[child->key_count] = node->keys[i];
+                    NODE_VALUES(child)[child->key_count] = NODE_VALUES(node)[i];
+                    if (!child->is_leaf)
+                        NODE_CHILDREN(child)[child->key_count + 1] = NODE_CHILDREN(right)[0];
+
+                    node->keys[i] = right->keys[0];
+                    NODE_VALUES(node)[i] = NODE_VALUES(right)[0];
+
+                    for (j = 0; j < right->key_count - 1; j++)
+                    {
+                        right->keys[j] = right->keys[j + 1];
+                        NODE_VALUES(right)[j] = NODE_VALUES(right)[j + 1];
+                    }
+                    if (!right->is_leaf)
+                        for (j = 0; j <= right->key_count - 1; j++)
+                            NODE_CHILDREN(right)[j] = NODE_CHILDREN(right)[j + 1];
+
+                    right->key_count--;
+                    child->key_count++;
+                }
+                else
+                {
+                    /* Merge with sibling */
+                    if (i < node->key_count)
+                    {
+                        merge_nodes(pool, node, i);
+                    }
+                    else
+                    {
+                        merge_nodes(pool, node, (unsigned char)(i - 1));
+                        i = (unsigned char)(i - 1);
+                    }
+
+                    child = NODE_CHILDREN(node)[i];
+                }
+            }
 
-        btree_delete_node(child, key);
+            node = child;
+        }
+        else
+            return; /* Not in the tree */
     }
 }
 
+#endif
+
 unsigned char btree_delete(BTree *tree, unsigned int key)
 {
     if (!tree || !tree->root)
@@ -428,14 +888,14 @@ unsigned char btree_delete(BTree *tree, unsigned int key)
     if (btree_get(tree, key) == NULL)
         return 0; /* Key not found */
 
-    btree_delete_node(tree->root, key);
+    btree_delete_node(tree->pool, tree->root, key);
 
-    if (tree->root->key_count == 0 && !tree->root->is_leaf && tree->root->children[0])
+    if (tree->root->key_count == 0 && !tree->root->is_leaf && NODE_CHILDREN(tree->root)[0])
     {
         BTreeNode *old_root;
         old_root = tree->root;
-        tree->root = old_root->children[0];
-        free(old_root);
+        tree->root = NODE_CHILDREN(old_root)[0];
+        node_free(tree->pool, old_root);
     }
 
     /* Verify deletion was successful */
@@ -445,6 +905,286 @@ unsigned char btree_delete(BTree *tree, unsigned int key)
     return 1;
 }
 
+#if BTREE_BPLUS
+/* Load the entry at index, following the leaf chain past used-up leaves */
+static unsigned char cursor_settle(BTreeCursor *cursor)
+{
+    while (cursor->leaf && cursor->index >= cursor->leaf->key_count)
+    {
+        cursor->leaf = cursor->leaf->u.leaf.next;
+        cursor->index = 0;
+    }
+
+    if (!cursor->leaf)
+    {
+        cursor->valid = 0;
+        return 0;
+    }
+
+    cursor->key = cursor->leaf->keys[cursor->index];
+    cursor->value = NODE_VALUES(cursor->leaf)[cursor->index];
+    cursor->valid = 1;
+    return 1;
+}
+
+unsigned char btree_cursor_seek(BTreeCursor *cursor, BTree *tree, unsigned int key)
+{
+    if (!cursor)
+        return 0;
+    cursor->valid = 0;
+    if (!tree || !tree->root)
+        return 0;
+
+    cursor->tree = tree;
+    cursor->leaf = leaf_find(tree->root, key);
+    cursor->index = node_find(cursor->leaf, key);
+    return cursor_settle(cursor);
+}
+
+unsigned char btree_cursor_last(BTreeCursor *cursor, BTree *tree)
+{
+    BTreeNode *node;
+
+    if (!cursor)
+        return 0;
+    cursor->valid = 0;
+    if (!tree || !tree->root || tree->root->key_count == 0)
+        return 0;
+
+    node = tree->root;
+    while (!node->is_leaf)
+        node = NODE_CHILDREN(node)[node->key_count];
+
+    cursor->tree = tree;
+    cursor->leaf = node;
+    cursor->index = (unsigned char)(node->key_count - 1);
+    return cursor_settle(cursor);
+}
+
+unsigned char btree_cursor_next(BTreeCursor *cursor)
+{
+    if (!cursor || !cursor->valid)
+        return 0;
+
+    cursor->index++;
+    return cursor_settle(cursor);
+}
+
+unsigned char btree_cursor_prev(BTreeCursor *cursor)
+{
+    BTreeNode *node;
+    BTreeNode *left;
+    unsigned char i;
+
+    if (!cursor || !cursor->valid)
+        return 0;
+
+    if (cursor->index > 0)
+    {
+        cursor->index--;
+        return cursor_settle(cursor);
+    }
+
+    /* Leaves only link forward: descend again for the largest key below
+     * the current one, remembering the nearest subtree to the left */
+    node = cursor->tree->root;
+    left = NULL;
+    while (!node->is_leaf)
+    {
+        i = node_find(node, cursor->key);
+        if (i > 0)
+            left = NODE_CHILDREN(node)[i - 1];
+        node = NODE_CHILDREN(node)[i];
+    }
+
+    i = node_find(node, cursor->key);
+    if (i == 0)
+    {
+        if (!left)
+        {
+            cursor->valid = 0;
+            return 0;
+        }
+        node = left;
+        while (!node->is_leaf)
+            node = NODE_CHILDREN(node)[node->key_count];
+        i = node->key_count;
+    }
+
+    cursor->leaf = node;
+    cursor->index = (unsigned char)(i - 1);
+    return cursor_settle(cursor);
+}
+
+#else
+/* Load the entry at index[depth], climbing to the separator after the
+ * child taken at each ancestor while the current node is used up */
+static unsigned char cursor_settle(BTreeCursor *cursor)
+{
+    BTreeNode *node;
+
+    for (;;)
+    {
+        node = cursor->path[cursor->depth];
+        if (cursor->index[cursor->depth] < node->key_count)
+            break;
+        if (cursor->depth == 0)
+        {
+            cursor->valid = 0;
+            return 0;
+        }
+        cursor->depth--;
+    }
+
+    cursor->key = node->keys[cursor->index[cursor->depth]];
+    cursor->value = NODE_VALUES(node)[cursor->index[cursor->depth]];
+    cursor->valid = 1;
+    return 1;
+}
+
+/* Walk from path[depth] down to the first (or last) key of its subtree */
+static void cursor_descend(BTreeCursor *cursor, unsigned char last)
+{
+    BTreeNode *node;
+    unsigned char i;
+
+    node = cursor->path[cursor->depth];
+    while (!node->is_leaf)
+    {
+        i = last ? node->key_count : 0;
+        cursor->index[cursor->depth] = i;
+        node = NODE_CHILDREN(node)[i];
+        cursor->path[++cursor->depth] = node;
+    }
+    cursor->index[cursor->depth] = (unsigned char)(last ? node->key_count - 1 : 0);
+}
+
+unsigned char btree_cursor_seek(BTreeCursor *cursor, BTree *tree, unsigned int key)
+{
+    BTreeNode *node;
+    unsigned char i;
+
+    if (!cursor)
+        return 0;
+    cursor->valid = 0;
+    if (!tree || !tree->root)
+        return 0;
+
+    cursor->depth = 0;
+    node = tree->root;
+
+    for (;;)
+    {
+        i = node_find(node, key);
+        cursor->path[cursor->depth] = node;
+        cursor->index[cursor->depth] = i;
+
+        if ((i < node->key_count && key == node->keys[i]) || node->is_leaf)
+            break;
+
+        node = NODE_CHILDREN(node)[i];
+        cursor->depth++;
+    }
+
+    return cursor_settle(cursor);
+}
+
+unsigned char btree_cursor_last(BTreeCursor *cursor, BTree *tree)
+{
+    if (!cursor)
+        return 0;
+    cursor->valid = 0;
+    if (!tree || !tree->root || tree->root->key_count == 0)
+        return 0;
+
+    cursor->depth = 0;
+    cursor->path[0] = tree->root;
+    cursor_descend(cursor, 1);
+    return cursor_settle(cursor);
+}
+
+unsigned char btree_cursor_next(BTreeCursor *cursor)
+{
+    BTreeNode *node;
+    unsigned char i;
+
+    if (!cursor || !cursor->valid)
+        return 0;
+
+    node = cursor->path[cursor->depth];
+    i = (unsigned char)(cursor->index[cursor->depth] + 1);
+    cursor->index[cursor->depth] = i;
+
+    /* The successor of an internal key is the first key right of it */
+    if (!node->is_leaf)
+    {
+        cursor->path[++cursor->depth] = NODE_CHILDREN(node)[i];
+        cursor_descend(cursor, 0);
+    }
+
+    return cursor_settle(cursor);
+}
+
+unsigned char btree_cursor_prev(BTreeCursor *cursor)
+{
+    BTreeNode *node;
+
+    if (!cursor || !cursor->valid)
+        return 0;
+
+    node = cursor->path[cursor->depth];
+
+    /* The predecessor of an internal key is the last key left of it;
+     * index[depth] already names that child */
+    if (!node->is_leaf)
+    {
+        node = NODE_CHILDREN(node)[cursor->index[cursor->depth]];
+        cursor->path[++cursor->depth] = node;
+        cursor_descend(cursor, 1);
+        return cursor_settle(cursor);
+    }
+
+    /* Otherwise the separator before the child taken, at the first
+     * ancestor that was not entered through its leftmost child */
+    while (cursor->index[cursor->depth] == 0)
+    {
+        if (cursor->depth == 0)
+        {
+            cursor->valid = 0;
+            return 0;
+        }
+        cursor->depth--;
+    }
+    cursor->index[cursor->depth]--;
+    return cursor_settle(cursor);
+}
+
+#endif
+
+unsigned int btree_range(BTree *tree, unsigned int lo, unsigned int hi,
+                         btree_range_callback_t callback, void *ctx)
+{
+    BTreeCursor cursor;
+    unsigned int count;
+
+    if (!callback || lo > hi)
+        return 0;
+
+    count = 0;
+    if (!btree_cursor_seek(&cursor, tree, lo))
+        return 0;
+
+    while (cursor.key <= hi)
+    {
+        callback(cursor.key, cursor.value, ctx);
+        count++;
+        if (!btree_cursor_next(&cursor))
+            break;
+    }
+
+    return count;
+}
+
 static void btree_print_node(BTreeNode *node, int depth)
 {
     unsigned char i;
@@ -458,12 +1198,17 @@ static void btree_print_node(BTreeNode *node, int depth)
 
     printf("Node: ");
     for (i = 0; i < node->key_count; i++)
-        printf("[%d:%d] ", node->keys[i], node->values[i]);
+#if BTREE_BPLUS
+        if (!node->is_leaf)
+            printf("[%d] ", node->keys[i]);
+        else
+#endif
+        printf("[%d:%d] ", node->keys[i], NODE_VALUES(node)[i]);
     putchar('\n');
 
     if (!node->is_leaf)
         for (i = 0; i <= node->key_count; i++)
-            btree_print_node(node->children[i], depth + 2);
+            btree_print_node(NODE_CHILDREN(node)[i], depth + 2);
 }
 
 void btree_print(BTree *tree)
@@ -478,18 +1223,33 @@ void btree_print(BTree *tree)
     btree_print_node(tree->root, 0);
 }
 
-static void btree_free_node(BTreeNode *node)
+static void btree_free_node(BTreePool *pool, BTreeNode *node)
 {
-    unsigned char i;
+    unsigned char depth;
 
     if (!node)
         return;
 
-    if (!node->is_leaf)
-        for (i = 0; i <= node->key_count; i++)
-            btree_free_node(node->children[i]);
+    depth = 0;
+    walk_path[0] = node;
+    walk_index[0] = 0;
+
+    for (;;)
+    {
+        node = walk_path[depth];
+        if (!node->is_leaf && walk_index[depth] <= node->key_count)
+        {
+            walk_path[depth + 1] = NODE_CHILDREN(node)[walk_index[depth]++];
+            walk_index[++depth] = 0;
+            continue;
+        }
 
-    free(node);
+        /* All children are gone: release the node itself */
+        node_free(pool, node);
+        if (depth == 0)
+            break;
+        depth--;
+    }
 }
 
 void btree_free(BTree *tree)
@@ -497,6 +1257,6 @@ void btree_free(BTree *tree)
     if (!tree)
         return;
 
-    btree_free_node(tree->root);
+    btree_free_node(tree->pool, tree->root);
     free(tree);
 }
@@ -2,7 +2,7 @@
 #define BTREE_H
 
 /* B-tree implementation for RP6502
- * Default order is 3 (max 2 keys per node, max 3 children)
+ * Default order is 10 (max 9 keys per node, max 10 children)
  * Parameterize the maximum number of children with BTREE_MAX_CHILDREN.
  * Suitable for 256-byte stack limit and 16-bit int.
  */
@@ -11,15 +11,63 @@
 #define BTREE_MAX_CHILDREN 10
 #endif
 
-#if (BTREE_MAX_CHILDREN < 3)
-#error "BTREE_MAX_CHILDREN must be at least 3"
+/* Full nodes are split on the way down, so an order 3 (2-3) tree would
+ * leave empty nodes behind */
+#if (BTREE_MAX_CHILDREN < 4)
+#error "BTREE_MAX_CHILDREN must be at least 4"
+#endif
+
+/* Define BTREE_BPLUS to 1 for a B+ tree: values only in leaves, which
+ * are linked in key order, and internal nodes of keys and children only */
+#ifndef BTREE_BPLUS
+#define BTREE_BPLUS 0
 #endif
 
 #define BTREE_MAX_KEYS (BTREE_MAX_CHILDREN - 1)
-#define BTREE_MIN_CHILDREN ((BTREE_MAX_CHILDREN + 1) / 2)
-#define BTREE_MIN_KEYS (BTREE_MIN_CHILDREN - 1)
+/* Smallest half of a split; for odd orders one less than ceil(order/2)-1 */
+#define BTREE_MIN_KEYS ((BTREE_MAX_KEYS - 1) / 2)
+#define BTREE_MIN_CHILDREN (BTREE_MIN_KEYS + 1)
 #define BTREE_SPLIT_INDEX (BTREE_MAX_KEYS / 2)
+/* B+ leaves split evenly, the smaller half going right */
+#define BTREE_LEAF_MIN_KEYS (BTREE_MAX_KEYS / 2)
+
+/* Deepest possible tree: every non-root node has at least two children
+ * and keys are distinct unsigned ints */
+#define BTREE_MAX_DEPTH (8 * sizeof(unsigned int) + 1)
+
+/* In-node search strategy. On the 6502 each linear step is a 16-bit
+ * compare through a pointer, so binary search pays off once nodes hold
+ * 8 or more keys; host compilers predict and unroll the linear scan,
+ * which stays faster there up to order 32. Define BTREE_BINARY_SEARCH to
+ * 0 or 1 to force one (see the order sweeps in the README). */
+#ifndef BTREE_BINARY_SEARCH
+#ifdef __CC65__
+#define BTREE_BINARY_SEARCH (BTREE_MAX_KEYS >= 8)
+#else
+#define BTREE_BINARY_SEARCH 0
+#endif
+#endif
 
+#if BTREE_BPLUS
+/* A leaf's values and next link fill the same space as an internal
+ * node's children, so a node is BTREE_MAX_KEYS pointers smaller than in
+ * the plain B-tree */
+typedef struct BTreeNode
+{
+    unsigned int keys[BTREE_MAX_KEYS];      /* Keys; separators in internal nodes */
+    union
+    {
+        struct BTreeNode *children[BTREE_MAX_CHILDREN]; /* Internal nodes */
+        struct
+        {
+            void *values[BTREE_MAX_KEYS];   /* Generic values - can store any pointer */
+            struct BTreeNode *next;         /* Next leaf in key order */
+        } leaf;
+    } u;
+    unsigned char key_count;   /* Number of keys in this node */
+    unsigned char is_leaf;     /* 1 if leaf, 0 if internal node */
+} BTreeNode;
+#else
 typedef struct BTreeNode
 {
     unsigned int keys[BTREE_MAX_KEYS];      /* Key storage */
@@ -28,17 +76,87 @@ typedef struct BTreeNode
     unsigned char key_count;   /* Number of keys in this node */
     unsigned char is_leaf;     /* 1 if leaf, 0 if internal node */
 } BTreeNode;
+#endif
+
+/* Node pool: nodes come from a caller-provided array instead of the heap.
+ * Released nodes go on a free list (linked through children[0]) and are
+ * reused first; nodes never handed out yet are taken from next_unused on,
+ * so initialising a pool costs nothing per node. A pool can be shared by
+ * several trees. */
+typedef struct
+{
+    BTreeNode *nodes;           /* arena of `capacity` nodes */
+    BTreeNode *free_list;       /* released nodes */
+    unsigned int capacity;
+    unsigned int next_unused;   /* first arena node never handed out */
+    unsigned int in_use;        /* nodes currently in trees */
+    unsigned int high_water;    /* most nodes ever in use at once */
+    unsigned int failures;      /* allocations refused: pool exhausted */
+} BTreePool;
 
 typedef struct
 {
     BTreeNode *root;
+    BTreePool *pool;            /* node source, NULL for malloc */
 } BTree;
 
+/* Cursor: a position in key order. Any insert or delete on the tree
+ * invalidates its cursors; seek again afterwards. */
+#if BTREE_BPLUS
+/* Next follows the leaf chain; prev re-descends from the root when it
+ * crosses into the previous leaf */
+typedef struct
+{
+    unsigned int key;           /* entry under the cursor, while valid */
+    void *value;
+    BTree *tree;
+    BTreeNode *leaf;
+    unsigned char index;
+    unsigned char valid;
+} BTreeCursor;
+#else
+/* Kept as the path from the root, so stepping to the next or previous key
+ * is amortized O(1) */
+typedef struct
+{
+    unsigned int key;           /* entry under the cursor, while valid */
+    void *value;
+    BTreeNode *path[BTREE_MAX_DEPTH];       /* root .. current node */
+    unsigned char index[BTREE_MAX_DEPTH];   /* child taken; key index at depth */
+    unsigned char depth;
+    unsigned char valid;
+} BTreeCursor;
+#endif
+
+/* Called by btree_range for each entry in key order; must not insert
+ * into or delete from the tree */
+typedef void (*btree_range_callback_t)(unsigned int key, void *value, void *ctx);
+
+/* Define BTREE_POOL_NODES to a node count to make btree_create draw its
+ * nodes from a static pool of that size (btree_default_pool) instead of
+ * the heap. */
+#ifndef BTREE_POOL_NODES
+#define BTREE_POOL_NODES 0
+#endif
+
+#if BTREE_POOL_NODES > 0
+extern BTreePool btree_default_pool;
+#endif
+
 /* Initialize a new B-tree */
 BTree *btree_create(void);
 
-/* Insert a key-value pair (value is a void pointer) */
-void btree_insert(BTree *tree, unsigned int key, void *value);
+/* Set up a node pool over `arena`, an array of `capacity` nodes */
+void btree_pool_init(BTreePool *pool, BTreeNode *arena, unsigned int capacity);
+
+/* Initialize a new B-tree whose nodes come from `pool` (the BTree header
+ * itself is still allocated with malloc, once) */
+BTree *btree_create_in_pool(BTreePool *pool);
+
+/* Insert a key-value pair (value is a void pointer). Returns 0 if a node
+ * could not be allocated; the key is then not inserted, and the tree
+ * stays valid. */
+unsigned char btree_insert(BTree *tree, unsigned int key, void *value);
 
 /* Search for a key, returns value pointer or NULL if not found */
 void *btree_get(BTree *tree, unsigned int key);
@@ -49,6 +167,23 @@ unsigned char btree_update(BTree *tree, unsigned int key, void *new_value);
 /* Delete a key from the tree */
 unsigned char btree_delete(BTree *tree, unsigned int key);
 
+/* Position the cursor on the first key >= key. Returns 1 if the cursor
+ * is on an entry, 0 if there is no such key. */
+unsigned char btree_cursor_seek(BTreeCursor *cursor, BTree *tree, unsigned int key);
+
+/* Position the cursor on the largest key. Returns 0 for an empty tree. */
+unsigned char btree_cursor_last(BTreeCursor *cursor, BTree *tree);
+
+/* Step to the next / previous key. Return 0, leaving the cursor invalid,
+ * when there is none. */
+unsigned char btree_cursor_next(BTreeCursor *cursor);
+unsigned char btree_cursor_prev(BTreeCursor *cursor);
+
+/* Call callback for every key in [lo, hi] in ascending order. Returns the
+ * number of entries visited. */
+unsigned int btree_range(BTree *tree, unsigned int lo, unsigned int hi,
+                         btree_range_callback_t callback, void *ctx);
+
 /* Print tree structure (for debugging) */
 void btree_print(BTree *tree);
 
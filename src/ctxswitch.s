@@ -3,8 +3,21 @@
 ; Expects two global C variables (absolute addresses):
 ;   ctx_cur  -> pointer to current task_t
 ;   ctx_next -> pointer to next task_t
-; It copies the entire hardware stack page ($0100-$01FF) into cur->stack and
-; copies next->stack back into memory, restores SP and saved registers.
+; It copies the used part of the hardware stack page (saved_sp+1..$FF) into
+; cur->stack, copies next's used part back into page 1, then restores SP and
+; saved registers. The copies are inline indexed loops (15-16 cycles/byte)
+; addressed through task.stack_base, so no C call is made mid-switch.
+; A buffer smaller than a page only holds page 1 offsets from ctx_stack_floor
+; up: both copies start no lower than that, and a task found deeper than its
+; buffer is flagged in task.overflow instead of writing past stack[].
+; Tasks in a page 1 partition (SCHED_STACK_PARTITIONS) have a NULL
+; stack_base and only have SP swapped.
+; The cc65 software stack pointer (sp) and register variables (regbank) are
+; switched per task as well. The other runtime zero page locations (ptr1..
+; tmp4, sreg, regsave) are caller-saved scratch and are dead across the C
+; call into ctx_switch, so they need no saving.
+
+    .include "zeropage.inc"   ; cc65 runtime: sp, regbank, regbanksize
 
     .segment "ZEROPAGE"
 ; zero page pointers / temps
@@ -23,10 +36,13 @@ stack_ptr:
     .global _ctx_switch
     .import _ctx_cur
     .import _ctx_next
+    .import _ctx_stack_floor
 
-; Offsets in task_t (must match C definition in scheduler.c)
+; Offsets in task_t (must match C definition in scheduler_task.h)
 ; fn: 0..1, arg:2..3, in_use:4, one_shot:5, started:6, saved_sp:7,
-; a:8, x:9, y:10, p:11, stack:12..(12+SCHED_TASK_STACK_SIZE-1)
+; a:8, x:9, y:10, p:11, wake_delta:12..13, stack_base:14..15,
+; stack_top:16, stack_guard:17, slice:18, overflow:19, csp:20..21,
+; regbank:22..27, stack:28..(28+SCHED_TASK_STACK_SIZE-1)
 FN_OFF = 0
 ARG_OFF = 2
 INUSE_OFF = 4
@@ -38,7 +54,13 @@ X_OFF = 9
 Y_OFF = 10
 P_OFF = 11
 WAKE_OFF = 12
-STACK_OFF = 14
+STACKBASE_OFF = 14
+OVERFLOW_OFF = 19
+CSP_OFF = 20
+REGBANK_OFF = 22
+STACK_OFF = 28
+
+.assert regbanksize = 6, error, "task_t.regbank[] must match the cc65 regbank size"
 
 ; ctx_switch: perform swap between *ctx_cur and *ctx_next
 _ctx_switch:
@@ -71,28 +93,106 @@ _ctx_switch:
     lda tmp_a+1
     sta (ctx_task_ptr),y
 
+    ; save cc65 C stack pointer and register variables
+    ldy #CSP_OFF
+    lda sp
+    sta (ctx_task_ptr),y
+    iny
+    lda sp+1
+    sta (ctx_task_ptr),y
+    .repeat regbanksize, I
+    iny
+    lda regbank+I
+    sta (ctx_task_ptr),y
+    .endrepeat
+
     ; save SP into task.saved_sp
     tsx
     ldy #SAVEDSP_OFF
     txa
     sta (ctx_task_ptr),y
 
-    ; call C helper to copy stacks: scheduler_copy_stacks()
-    .import _scheduler_copy_stacks
-    jsr _scheduler_copy_stacks
+    ; stack_ptr <- cur.stack_base. A partitioned task has stack_base == NULL
+    ; (buffers live at $0200 or above, so a real base never has high byte 0)
+    ; and its stack stays in its page 1 slice: skip the copy.
+    ldy #STACKBASE_OFF
+    lda (ctx_task_ptr),y
+    sta stack_ptr
+    iny
+    lda (ctx_task_ptr),y
+    beq save_done
+    sta stack_ptr+1
 
-    ; set ctx_task_ptr to point to _ctx_next so we can read next.saved_sp
+    ; copy $0100+saved_sp+1..$01FF into stack_base[saved_sp+1..$FF]
+    txa
+    tay
+    iny
+    beq save_done       ; saved_sp == $FF: nothing on the stack
+    cpy _ctx_stack_floor
+    bcs save_loop
+    ; deeper than the buffer: flag it and keep only what fits
+    ldy #OVERFLOW_OFF
+    lda #1
+    sta (ctx_task_ptr),y
+    ldy _ctx_stack_floor
+save_loop:
+    lda $0100,y
+    sta (stack_ptr),y
+    iny
+    bne save_loop
+save_done:
+
+    ; set ctx_task_ptr to point to _ctx_next
     lda _ctx_next
     sta ctx_task_ptr
     lda _ctx_next+1
     sta ctx_task_ptr+1
 
-    ; restore SP from next.saved_sp
     ldy #SAVEDSP_OFF
     lda (ctx_task_ptr),y
-    tax
+    tax                 ; X <- next.saved_sp
+
+    ; stack_ptr <- next.stack_base; NULL (partitioned) only swaps SP
+    ldy #STACKBASE_OFF+1
+    lda (ctx_task_ptr),y
+    beq restore_done
+    sta stack_ptr+1
+    dey
+    lda (ctx_task_ptr),y
+    sta stack_ptr
+
+    ; copy next.stack_base[saved_sp+1..$FF] back into page 1. Nothing is
+    ; pushed until SP is switched, so the current frame is not disturbed.
+    txa
+    tay
+    iny
+    beq restore_done
+    cpy _ctx_stack_floor
+    bcs restore_loop
+    ldy _ctx_stack_floor   ; nothing was saved below the buffer
+restore_loop:
+    lda (stack_ptr),y
+    sta $0100,y
+    iny
+    bne restore_loop
+restore_done:
+
+    ; restore SP from next.saved_sp
     txs
 
+    ; restore cc65 C stack pointer and register variables
+    ldy #CSP_OFF
+    lda (ctx_task_ptr),y
+    sta sp
+    iny
+    lda (ctx_task_ptr),y
+    sta sp+1
+    .repeat regbanksize, I
+    iny
+    lda (ctx_task_ptr),y
+    sta regbank+I
+    .endrepeat
+
     ; restore registers A/X/Y/P from next task struct
     ldy #P_OFF
     lda (ctx_task_ptr),y
@@ -77,7 +77,7 @@ static void fail_halt(const char *msg, unsigned int a, unsigned int b);
 
 /* ========== TCP UART Helper Functions ========== */
 
-/* Idle task to keep ticks advancing when all other tasks are sleeping. */
+/* Idle task: runs while all other tasks sleep and is excluded from CPU usage. */
 static void idle_task(void *arg)
 {
     (void)arg;
@@ -102,6 +102,13 @@ static unsigned int test_producer_index = 0;
 /* Per-producer pending items (indexed by producer_id - 1) */
 static int producer_pending_items[NUM_PRODUCERS];
 static unsigned char producer_started[NUM_PRODUCERS];
+/* Topic handle per consumer, resolved once in main() */
+static int consumer_topics[NUM_CONSUMERS];
+
+/* Coordination: tasks block on these instead of polling */
+#define TEST_EV_ALL_CONSUMED 0x01
+#define TEST_EV_VALIDATED    0x02
+static scheduler_event_t test_events;
 
 /* Timing tracking */
 static unsigned int time_test_started = 0;
@@ -120,6 +127,13 @@ static unsigned char timing_all_produced_recorded = 0;
 static unsigned char timing_all_consumed_recorded = 0;
 static unsigned char timing_validation_recorded = 0;
 
+/* Scheduler ticks to milliseconds (0 when ticks count context switches) */
+static unsigned long ticks_to_ms(unsigned int t)
+{
+    unsigned int tps = scheduler_ticks_per_second();
+    return tps ? (unsigned long)t * 1000UL / tps : 0UL;
+}
+
 /* Initialize producer tracking arrays */
 static void init_producer_tracking(void) {
     int i;
@@ -155,12 +169,10 @@ static void test_producer_task(void *arg)
 {
     int pool_exhausted_this_round;
     int has_pending;
-    int publish_succeeded;
     int consumer_idx;
     PubSubMessage msg;
     int producer_id = (int)(unsigned long)arg;
     int producer_idx = producer_id - 1;  /* Array index (0-based) */
-    char topic_name[32];
     int *pending_ptr = &producer_pending_items[producer_idx];
     
     if (!producer_started[producer_idx]) {
@@ -172,7 +184,6 @@ static void test_producer_task(void *arg)
     while (!test_validation_complete) {
         pool_exhausted_this_round = 0;
         has_pending = (*pending_ptr >= 0) ? 1 : 0;
-        publish_succeeded = 0;
         
         /* If no pending item, try to get next one from pool */
         if (*pending_ptr < 0) {
@@ -196,9 +207,10 @@ static void test_producer_task(void *arg)
             
             /* Distribute items round-robin to consumers by topic */
             consumer_idx = (*pending_ptr) % NUM_CONSUMERS;
-            snprintf(topic_name, sizeof(topic_name), "test_items_consumer_%d", consumer_idx);
             
-            if (pubsub_publish(&g_pubsub_mgr, topic_name, &msg)) {
+            /* Blocks while the consumer topic is full; the topic's
+             * consumer task wakes us once it has drained */
+            if (pubsub_publish_wait_id(&g_pubsub_mgr, consumer_topics[consumer_idx], &msg)) {
                 if (test_items[*pending_ptr].has_json) {
                     printf("[TEST_PRODUCER_%d] Published item %d JSON to consumer_%d: %s\n", 
                            producer_id, *pending_ptr, consumer_idx, test_items[*pending_ptr].json_data);
@@ -212,34 +224,28 @@ static void test_producer_task(void *arg)
                 if (!timing_first_produced_recorded) {
                     time_first_produced = scheduler_get_ticks();
                     timing_first_produced_recorded = 1;
-                    printf("[TIMING] First item produced at tick %u (elapsed: %u ms)\n", 
-                           time_first_produced, time_first_produced - time_test_started);
+                    printf("[TIMING] First item produced at tick %u (elapsed: %lu ms)\n", 
+                           time_first_produced, ticks_to_ms(time_first_produced - time_test_started));
                 }
                 
                 /* Record timing for all produced */
                 if (test_items_produced >= TEST_ITEM_COUNT && !timing_all_produced_recorded) {
                     time_all_produced = scheduler_get_ticks();
                     timing_all_produced_recorded = 1;
-                    printf("[TIMING] All %u items produced at tick %u (elapsed: %u ms)\n", 
-                           TEST_ITEM_COUNT, time_all_produced, time_all_produced - time_test_started);
+                    printf("[TIMING] All %u items produced at tick %u (elapsed: %lu ms)\n", 
+                           TEST_ITEM_COUNT, time_all_produced, ticks_to_ms(time_all_produced - time_test_started));
                 }
                 
                 *pending_ptr = -1;  /* Mark item as successfully sent */
-                publish_succeeded = 1;
-            } else {
-                if (has_pending) {
-                    printf("[TEST_PRODUCER_%d] Retrying pending item %d (queue full)\n", producer_id, *pending_ptr);
-                }
             }
         }
         
         /* Yield to allow other tasks to run */
         if (pool_exhausted_this_round && !has_pending) {
-            scheduler_sleep(100);  /* Long sleep when pool exhausted and nothing pending */
-        } else if (!publish_succeeded && has_pending) {
-            scheduler_sleep(50);   /* Medium sleep when retrying pending item */
+            /* Nothing left to produce: block until validation completes */
+            scheduler_event_wait(&test_events, TEST_EV_VALIDATED, SCHED_EVENT_ANY);
         } else {
-            scheduler_sleep(10);   /* Short sleep after successful publish or getting new item */
+            scheduler_sleep(scheduler_ms_to_ticks(10));   /* Short sleep after successful publish or getting new item */
         }
     }
 }
@@ -282,8 +288,9 @@ static void test_item_consumer(const char *topic, const PubSubMessage *message,
         if (test_items_consumed >= TEST_ITEM_COUNT && !timing_all_consumed_recorded) {
             time_all_consumed = scheduler_get_ticks();
             timing_all_consumed_recorded = 1;
-            printf("[TIMING] All %u items consumed at tick %u (elapsed: %u ms)\n", 
-                   TEST_ITEM_COUNT, time_all_consumed, time_all_consumed - time_test_started);
+            printf("[TIMING] All %u items consumed at tick %u (elapsed: %lu ms)\n", 
+                   TEST_ITEM_COUNT, time_all_consumed, ticks_to_ms(time_all_consumed - time_test_started));
+            scheduler_event_set(&test_events, TEST_EV_ALL_CONSUMED);
         }
     }
     
@@ -291,43 +298,47 @@ static void test_item_consumer(const char *topic, const PubSubMessage *message,
     (void)user_data;
 }
 
+/* Walks the test btree in key order alongside validation_index, so each
+ * item costs one cursor step instead of a root-to-leaf btree_get */
+static BTreeCursor validation_cursor;
+
 /* Validator task: checks all sent items are in the btree */
 static void test_validator_task(void *arg)
 {
-    static unsigned int validation_index = 0;
-    static unsigned int validation_passed = 0;
-    static unsigned int validation_failed = 0;
-    static unsigned int validator_phase = 0;  /* 0=waiting, 1=validating, 2=done */
+    /* Plain locals: each task runs on its own C stack */
+    unsigned int validation_index = 0;
+    unsigned int validation_passed = 0;
+    unsigned int validation_failed = 0;
+    unsigned int validator_phase = 0;  /* 0=waiting, 1=validating, 2=done */
     void *retrieved_value;
     unsigned long expected;
     
     (void)arg;
     
-    if (validation_index == 0 && validator_phase == 0) {
-        printf("[TEST_VALIDATOR] Starting validator task\n");
-        printf("[TEST_VALIDATOR] Waiting for all %u items to be consumed...\n", TEST_ITEM_COUNT);
-    }
+    printf("[TEST_VALIDATOR] Starting validator task\n");
+    printf("[TEST_VALIDATOR] Waiting for all %u items to be consumed...\n", TEST_ITEM_COUNT);
     
     /* Infinite loop with phases */
     while (1) {
         /* Phase 0: Wait for all items to be consumed */
         if (validator_phase == 0) {
-            printf("[TEST_VALIDATOR] Progress: %u/%u consumed\n", 
-                   test_items_consumed, TEST_ITEM_COUNT);
-            
-            if (test_items_consumed >= TEST_ITEM_COUNT) {
-                printf("[TEST_VALIDATOR] All items consumed, validating...\n");
-                validator_phase = 1;
-                validation_index = 0;
-            } else {
-                scheduler_sleep(200);
-            }
+            scheduler_event_wait(&test_events, TEST_EV_ALL_CONSUMED, SCHED_EVENT_ANY);
+            printf("[TEST_VALIDATOR] All items consumed, validating...\n");
+            validator_phase = 1;
+            validation_index = 0;
+            btree_cursor_seek(&validation_cursor, g_test_btree, 0);
         }
         /* Phase 1: Validate items one per invocation */
         else if (validator_phase == 1) {
             if (validation_index < TEST_ITEM_COUNT) {
                 if (g_test_btree != NULL) {
-                    retrieved_value = btree_get(g_test_btree, validation_index);
+                    /* Keys are 0..TEST_ITEM_COUNT-1, so a missing item shows
+                     * up as the cursor sitting on a larger key */
+                    retrieved_value = NULL;
+                    if (validation_cursor.valid && validation_cursor.key == validation_index) {
+                        retrieved_value = validation_cursor.value;
+                        btree_cursor_next(&validation_cursor);
+                    }
                     
                     /* Validate JSON items */
                     if (validation_index < JSON_ITEM_COUNT && test_items[validation_index].has_json) {
@@ -363,7 +374,7 @@ static void test_validator_task(void *arg)
                     validator_phase = 2;
                 }
                 validation_index++;
-                scheduler_sleep(50);
+                scheduler_yield();
             } else {
                 /* All items validated, move to phase 2 */
                 validator_phase = 2;
@@ -383,10 +394,10 @@ static void test_validator_task(void *arg)
                 timing_validation_recorded = 1;
             }
             
-            /* Total time is from system clock - it's the only reliable wall-clock source.
-             * If it shows incorrectly, check that CLOCKS_PER_SEC is correct for your platform. */
-            total_time = 0;
-            if (sys_clock_at_end > sys_clock_at_start) {
+            /* Total time comes from the scheduler's tick source when it runs in
+             * real time, otherwise from the system clock. */
+            total_time = (unsigned int)ticks_to_ms(time_validation_complete - time_test_started);
+            if (total_time == 0 && sys_clock_at_end > sys_clock_at_start) {
                 clock_t sys_elapsed = sys_clock_at_end - sys_clock_at_start;
                 clock_t clocks_per_sec = CLOCKS_PER_SEC;
                 total_time = (clocks_per_sec > 0) ? (unsigned int)((sys_elapsed * 1000) / clocks_per_sec) : 0;
@@ -427,14 +438,10 @@ static void test_validator_task(void *arg)
                 clock_t sys_elapsed;
                 clock_t clocks_per_sec;
                 unsigned int ms_elapsed;
-                unsigned int adjusted_ms;
-                unsigned long scheduler_tick_count;
                 
                 sys_elapsed = sys_clock_at_end - sys_clock_at_start;
                 clocks_per_sec = CLOCKS_PER_SEC;
                 ms_elapsed = 0;
-                adjusted_ms = 0;
-                scheduler_tick_count = (unsigned long)(time_validation_complete - time_test_started);
                 
                 printf("[TEST_VALIDATOR] System clock start:   %lu\n", (unsigned long)sys_clock_at_start);
                 printf("[TEST_VALIDATOR] System clock end:     %lu\n", (unsigned long)sys_clock_at_end);
@@ -445,42 +452,11 @@ static void test_validator_task(void *arg)
                     ms_elapsed = (unsigned int)((sys_elapsed * 1000) / clocks_per_sec);
                     printf("[TEST_VALIDATOR] Calculated time (from clock()): %u.%03u seconds\n", 
                            ms_elapsed / 1000, ms_elapsed % 1000);
-                    
-                    /* Use scheduler ticks to detect and correct miscalibration */
-                    /* Typical yield/context switch takes ~10-100us, so with ~27000 ticks in 108s,
-                       each tick is ~4ms, giving ~250 ticks/second */
-                    if (scheduler_tick_count > 1000) {
-                        /* Calculate estimated elapsed time from scheduler ticks
-                           Assumption: a well-tuned scheduler has 200-500 ticks/second */
-                        unsigned long ticks_per_sec_min = 100;
-                        unsigned long ticks_per_sec_max = 500;
-                        unsigned long implied_ticks_per_sec = (scheduler_tick_count * 1000) / ms_elapsed;
-                        
-                        if (implied_ticks_per_sec > ticks_per_sec_max || 
-                            implied_ticks_per_sec < ticks_per_sec_min) {
-                            /* clock() likely miscalibrated - try to detect correction factor */
-                            unsigned long expected_ticks_per_sec = 250;  /* typical value */
-                            unsigned long corrected_ms = (scheduler_tick_count * 1000) / expected_ticks_per_sec;
-                            unsigned long factor_num = (corrected_ms * 100) / ms_elapsed;  /* factor * 100 for integer math */
-                            printf("[TEST_VALIDATOR] [AUTO-CALIBRATION] Detected clock() miscalibration\n");
-                            printf("[TEST_VALIDATOR]   Implied ticks/sec from clock(): %lu\n", implied_ticks_per_sec);
-                            printf("[TEST_VALIDATOR]   Expected ticks/sec: ~%lu\n", expected_ticks_per_sec);
-                            printf("[TEST_VALIDATOR]   Correction factor: %lu.%02lu\n", 
-                                   factor_num / 100, factor_num % 100);
-                            printf("[TEST_VALIDATOR]   Corrected time: %lu.%03lu seconds\n",
-                                   corrected_ms / 1000, corrected_ms % 1000);
-                            total_time = (unsigned int)corrected_ms;
-                        } else {
-                            total_time = ms_elapsed;
-                        }
-                    } else {
-                        total_time = ms_elapsed;
-                    }
                 }
             }
-            
-            /* Note: If auto-calibration adjusts the time significantly, it means 
-             * clock() and CLOCKS_PER_SEC are not properly configured for your environment. */
+            printf("[TEST_VALIDATOR] Scheduler tick rate: %u ticks/sec%s\n",
+                   scheduler_ticks_per_second(),
+                   scheduler_ticks_per_second() ? "" : " (one tick per switch)");
             
             if (validation_failed == 0) {
                 printf("[TEST_VALIDATOR] ========== ALL VALIDATIONS PASSED! ==========\n");
@@ -489,12 +465,13 @@ static void test_validator_task(void *arg)
             }
             
             test_validation_complete = 1;
+            scheduler_event_set(&test_events, TEST_EV_VALIDATED);
             validator_phase = 3;  /* Mark as fully done */
         }
-        /* Phase 3: Keep running but do nothing */
+        /* Phase 3: Done - return and let the scheduler retire the task */
         else {
-            scheduler_sleep(100);
-            break;  /* Exit the loop but not the function - will be called again */
+            scheduler_sleep(scheduler_ms_to_ticks(100));
+            break;
         }
     }
 }
@@ -506,13 +483,11 @@ static void test_cleanup_task(void *arg)
     
     printf("[CLEANUP] Waiting for validation to complete...\n");
     
-    while (!test_validation_complete) {
-        scheduler_sleep(100);
-    }
+    scheduler_event_wait(&test_events, TEST_EV_VALIDATED, SCHED_EVENT_ANY);
     
     printf("[CLEANUP] Validation complete! All tests finished.\n");
     printf("[CLEANUP] Halting system...\n");
-    scheduler_sleep(500);
+    scheduler_sleep(scheduler_ms_to_ticks(500));
     
     /* Halt the system by disabling interrupts and entering infinite loop */
 #if defined(__CC65__)
@@ -526,7 +501,6 @@ static void test_cleanup_task(void *arg)
 
 static void pubsub_monitor(void *arg)
 {
-    static unsigned int empty_count = 0;
     unsigned int queue_size;
     unsigned int i;
     
@@ -535,8 +509,8 @@ static void pubsub_monitor(void *arg)
     printf("[MONITOR] Starting pubsub monitor task\n");
     
     for (;;) {
-        /* Process queued messages FIRST to ensure minimal latency */
-        pubsub_process_all(&g_pubsub_mgr);
+        /* Dispatch happens in the per-topic consumer tasks; this task
+         * only reports queue depths */
         
         /* Check if validation is complete */
         if (test_validation_complete) {
@@ -550,14 +524,13 @@ static void pubsub_monitor(void *arg)
             printf(" none\n");
         } else {
             for (i = 0; i < g_pubsub_mgr.topic_count; i++) {
-                queue_size = pubsub_queue_size(&g_pubsub_mgr, g_pubsub_mgr.topics[i].name);
+                queue_size = pubsub_queue_size_id(&g_pubsub_mgr, (int)i);
                 printf(" %s=%u", g_pubsub_mgr.topics[i].name, queue_size);
             }
             printf("\n");
         }
 
-        /* Reduced sleep to ensure frequent message processing */
-        scheduler_sleep(50);
+        scheduler_sleep(scheduler_ms_to_ticks(50));
     }
 }
 
@@ -566,6 +539,7 @@ void main()
     unsigned int i;
     unsigned int producer_id;
     char topic_name[32];
+    PubSubTopicConfig topic_config;
     
     scheduler_init();
 
@@ -616,16 +590,26 @@ void main()
         
         /* Initialize producer tracking */
         init_producer_tracking();
+        scheduler_event_init(&test_events);
         printf("[MAIN] Creating %u consumer topics for work-queue distribution...\n", 
                NUM_CONSUMERS);
 
-        /* Create one topic per consumer for work-queue distribution */
+        /* Create one topic per consumer for work-queue distribution;
+         * these carry every test item, so give them deep rings */
+        pubsub_topic_config_init(&topic_config);
+        topic_config.depth = 64;
         for (i = 0; i < NUM_CONSUMERS; i++) {
             snprintf(topic_name, sizeof(topic_name), "test_items_consumer_%d", i);
-            pubsub_create_topic(&g_pubsub_mgr, topic_name);
-            pubsub_subscribe(&g_pubsub_mgr, topic_name, 
-                            test_item_consumer, (void *)(unsigned long)i);
+            consumer_topics[i] = pubsub_create_topic_ex(&g_pubsub_mgr, topic_name,
+                                                        &topic_config);
+            pubsub_subscribe_id(&g_pubsub_mgr, consumer_topics[i], 
+                                test_item_consumer, (void *)(unsigned long)i);
+            /* Dispatch is latency-critical: run subscribers as soon as
+             * a producer yields after publishing */
+            pubsub_start_consumer_id(&g_pubsub_mgr, consumer_topics[i], SCHED_PRIO_HIGH);
         }
+        printf("[MAIN] Pub/sub memory: %u of %u bytes\n",
+               pubsub_memory_usage(&g_pubsub_mgr), (unsigned int)sizeof(g_pubsub_mgr));
 
         scheduler_add(pubsub_monitor, NULL);
         
@@ -634,9 +618,10 @@ void main()
             scheduler_add(test_producer_task, (void *)(unsigned long)producer_id);
         }
         
-        scheduler_add(test_validator_task, NULL);
-        scheduler_add(test_cleanup_task, NULL);
-        scheduler_add(idle_task, NULL);
+        /* Validation and cleanup are not latency-critical */
+        scheduler_add_prio(test_validator_task, NULL, SCHED_PRIO_LOW);
+        scheduler_add_prio(test_cleanup_task, NULL, SCHED_PRIO_LOW);
+        scheduler_set_idle_task(scheduler_add(idle_task, NULL));
     #endif
 
     scheduler_run();
@@ -7,20 +7,23 @@
 #include <string.h>
 #include <stdlib.h>
 
-/* Simple spinlock implementation */
-static void _lock(volatile unsigned int *lock)
-{
-    while (*lock) {
-        /* Busy wait */
-    }
+/* _lock and topic_lock are true once the lock is held. They are false
+ * when scheduler_mutex_lock refuses: a relock by the holder, or a call
+ * outside any task (or a deadlock) while another task holds it. Callers
+ * then return their failure value without touching the topic. */
+#if PUBSUB_LOCKING
+#define _lock_init(lock) scheduler_mutex_init(lock)
+#define _lock(lock) (scheduler_mutex_lock(lock) == 0)
+#define _unlock(lock) scheduler_mutex_unlock(lock)
+#else
+#define _lock_init(lock) ((void)(lock))
+#define _lock(lock) ((void)(lock), 1)
+#define _unlock(lock) ((void)(lock))
+#endif
 
-    *lock = 1;
-}
-
-static void _unlock(volatile unsigned int *lock)
-{
-    *lock = 0;
-}
+/* Topic ring lock, skipped for SPSC topics */
+#define topic_lock(t) ((t)->spsc || _lock(&(t)->lock))
+#define topic_unlock(t) do { if (!(t)->spsc) _unlock(&(t)->lock); } while (0)
 
 void pubsub_init(PubSubManager *mgr)
 {
@@ -30,7 +33,9 @@ void pubsub_init(PubSubManager *mgr)
     
     mgr->topic_count = 0;
     mgr->subscriber_count = 0;
-    mgr->lock = 0;
+    mgr->pool_used = 0;
+    mgr->external_bytes = 0;
+    _lock_init(&mgr->lock);
     mgr->mqtt.publish = NULL;
     mgr->mqtt.poll = NULL;
     mgr->mqtt.ctx = NULL;
@@ -39,25 +44,91 @@ void pubsub_init(PubSubManager *mgr)
     /* Initialize topics */
     for (i = 0; i < PUBSUB_MAX_TOPICS; i++) {
         mgr->topics[i].name[0] = '\0';
+        mgr->topics[i].message_queue = NULL;
+        mgr->topics[i].queue_mask = 0;
         mgr->topics[i].queue_head = 0;
         mgr->topics[i].queue_tail = 0;
-        mgr->topics[i].lock = 0;
+        mgr->topics[i].spsc = 0;
+        mgr->topics[i].draining = 0;
+        mgr->topics[i].payload = NULL;
+        mgr->topics[i].payload_shift = 0;
+        mgr->topics[i].buffers = NULL;
+        mgr->topics[i].high_water = 0;
+        mgr->topics[i].low_water = 0;
+        scheduler_waitq_init(&mgr->topics[i].space);
+        scheduler_waitq_init(&mgr->topics[i].readers);
+        mgr->topics[i].consumer = PUBSUB_NO_CONSUMER;
+        mgr->topics[i].mgr = mgr;
+        _lock_init(&mgr->topics[i].lock);
+        mgr->topics[i].first_subscriber = PUBSUB_NO_SUBSCRIBER;
     }
     
     /* Initialize subscribers */
     for (i = 0; i < PUBSUB_MAX_SUBSCRIBERS; i++) {
-        mgr->subscribers[i].topic_name[0] = '\0';
+        mgr->subscribers[i].topic_id = -1;
         mgr->subscribers[i].callback = NULL;
+        mgr->subscribers[i].callback_batch = NULL;
         mgr->subscribers[i].user_data = NULL;
         mgr->subscribers[i].active = false;
+        mgr->subscribers[i].next = PUBSUB_NO_SUBSCRIBER;
     }
 }
 
-int pubsub_create_topic(PubSubManager *mgr, const char *topic_name)
+/* log2 of a power of two up to 2^15; 0xFF for anything else */
+static unsigned char pow2_shift(unsigned int v)
 {
-    unsigned int i;
+    unsigned char shift = 0;
+    
+    if (v == 0 || (v & (v - 1)) != 0)
+        return 0xFF;
+    while (v > 1) {
+        v >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/* Round a requested depth up to a power of two; 0 if it cannot be met */
+static unsigned char ring_depth(unsigned char depth)
+{
+    unsigned char d = 2;
     
-    if (!mgr || !topic_name || mgr->topic_count >= PUBSUB_MAX_TOPICS)
+    if (depth == 0)
+        return PUBSUB_MESSAGE_QUEUE_SIZE;
+    if (depth > PUBSUB_MAX_QUEUE_DEPTH)
+        return 0;
+    while (d < depth)
+        d <<= 1;
+    return d;
+}
+
+void pubsub_topic_config_init(PubSubTopicConfig *config)
+{
+    if (!config)
+        return;
+    config->depth = 0;
+    config->buffer = NULL;
+    config->spsc = 0;
+    config->payload_size = 0;
+    config->payload_buffer = NULL;
+    config->buffers = NULL;
+    config->high_water = 0;
+    config->low_water = 0;
+}
+
+int pubsub_create_topic_ex(PubSubManager *mgr, const char *topic_name,
+                           const PubSubTopicConfig *config)
+{
+    unsigned int i;
+    unsigned int needed;
+    unsigned char depth;
+    unsigned char shift = 0;
+    unsigned int payload_bytes = 0;
+    unsigned char high, low;
+    PubSubMessage *ring;
+    unsigned char *payload = NULL;
+    
+    if (!mgr || !topic_name || !config || mgr->topic_count >= PUBSUB_MAX_TOPICS)
         return -1;
     
     /* Check if topic already exists */
@@ -66,20 +137,72 @@ int pubsub_create_topic(PubSubManager *mgr, const char *topic_name)
             return (int)i;  /* Topic already exists */
     }
     
+    depth = ring_depth(config->depth);
+    if (depth == 0 || (config->buffer && depth != config->depth))
+        return -1;  /* too deep, or caller's buffer is not a power of two */
+    
+    high = config->high_water ? config->high_water : depth;
+    low = config->low_water ? config->low_water : (unsigned char)(depth / 2);
+    if (high > depth || low >= high)
+        return -1;
+    
+    if (config->payload_size) {
+        shift = pow2_shift(config->payload_size);
+        if (shift == 0xFF || config->payload_size > PUBSUB_MAX_PAYLOAD)
+            return -1;
+        payload_bytes = (unsigned int)depth << shift;
+    }
+    
+    /* Pool messages needed for whatever the caller did not supply */
+    needed = config->buffer ? 0 : depth;
+    if (payload_bytes && !config->payload_buffer)
+        needed += (payload_bytes + sizeof(PubSubMessage) - 1) / sizeof(PubSubMessage);
+    
     /* Add new topic */
-    _lock(&mgr->lock);
+    if (!_lock(&mgr->lock))
+        return -1;
     
-    if (mgr->topic_count >= PUBSUB_MAX_TOPICS) {
+    if (mgr->topic_count >= PUBSUB_MAX_TOPICS ||
+        mgr->pool_used + needed > PUBSUB_POOL_MESSAGES) {
         _unlock(&mgr->lock);
         return -1;
     }
     
+    if (config->buffer) {
+        ring = config->buffer;
+        mgr->external_bytes += depth * sizeof(PubSubMessage);
+    } else {
+        ring = &mgr->pool[mgr->pool_used];
+    }
+    if (payload_bytes) {
+        if (config->payload_buffer) {
+            payload = config->payload_buffer;
+            mgr->external_bytes += payload_bytes;
+        } else {
+            payload = (unsigned char *)&mgr->pool[mgr->pool_used + (config->buffer ? 0 : depth)];
+        }
+    }
+    mgr->pool_used += needed;
+    
     i = mgr->topic_count;
     strncpy(mgr->topics[i].name, topic_name, PUBSUB_MAX_TOPIC_NAME - 1);
     mgr->topics[i].name[PUBSUB_MAX_TOPIC_NAME - 1] = '\0';
+    mgr->topics[i].message_queue = ring;
+    mgr->topics[i].queue_mask = (unsigned char)(depth - 1);
     mgr->topics[i].queue_head = 0;
     mgr->topics[i].queue_tail = 0;
-    mgr->topics[i].lock = 0;
+    mgr->topics[i].spsc = config->spsc;
+    mgr->topics[i].draining = 0;
+    mgr->topics[i].payload = payload;
+    mgr->topics[i].payload_shift = shift;
+    mgr->topics[i].buffers = config->buffers;
+    mgr->topics[i].high_water = high;
+    mgr->topics[i].low_water = low;
+    scheduler_waitq_init(&mgr->topics[i].space);
+    scheduler_waitq_init(&mgr->topics[i].readers);
+    mgr->topics[i].consumer = PUBSUB_NO_CONSUMER;
+    _lock_init(&mgr->topics[i].lock);
+    mgr->topics[i].first_subscriber = PUBSUB_NO_SUBSCRIBER;
     
     mgr->topic_count++;
     
@@ -87,89 +210,354 @@ int pubsub_create_topic(PubSubManager *mgr, const char *topic_name)
     return (int)i;
 }
 
-PubSubTopic* pubsub_get_topic(PubSubManager *mgr, const char *topic)
+int pubsub_create_topic(PubSubManager *mgr, const char *topic_name)
+{
+    PubSubTopicConfig config;
+    pubsub_topic_config_init(&config);
+    return pubsub_create_topic_ex(mgr, topic_name, &config);
+}
+
+int pubsub_create_topic_spsc(PubSubManager *mgr, const char *topic_name)
+{
+    PubSubTopicConfig config;
+    pubsub_topic_config_init(&config);
+    config.spsc = 1;
+    return pubsub_create_topic_ex(mgr, topic_name, &config);
+}
+
+int pubsub_topic_id(PubSubManager *mgr, const char *topic)
 {
     unsigned int i;
     
     if (!mgr || !topic)
-        return NULL;
+        return -1;
     
     for (i = 0; i < mgr->topic_count; i++) {
         if (strcmp(mgr->topics[i].name, topic) == 0)
-            return &mgr->topics[i];
+            return (int)i;
     }
     
-    return NULL;
+    return -1;
+}
+
+PubSubTopic* pubsub_get_topic(PubSubManager *mgr, const char *topic)
+{
+    int id = pubsub_topic_id(mgr, topic);
+    return id < 0 ? NULL : &mgr->topics[id];
+}
+
+/* Topic for a handle, or NULL if the handle is out of range */
+static PubSubTopic *topic_by_id(PubSubManager *mgr, int topic_id)
+{
+    if (!mgr || topic_id < 0 || (unsigned int)topic_id >= mgr->topic_count)
+        return NULL;
+    return &mgr->topics[topic_id];
 }
 
-static bool pubsub_publish_internal(PubSubManager *mgr, const char *topic, 
+/* Wake tasks blocked in pubsub_wait; call after advancing head */
+#define data_queued(t) do { \
+    if (!scheduler_waitq_empty(&(t)->readers)) \
+        scheduler_wake_all(&(t)->readers); \
+} while (0)
+
+/* Wake blocked publishers once a consumer has drained to low_water.
+ * Call with the topic locked, after moving tail. */
+#define space_freed(t) do { \
+    if ((unsigned char)((t)->queue_head - (t)->queue_tail) <= (t)->low_water) \
+        scheduler_wake_all(&(t)->space); \
+} while (0)
+
+/* Pool buffer references held by queued messages (no-ops without a pool).
+ * message_ref is false when the buffer already has 255 holders. */
+#define message_ref(t, m) (!(t)->buffers || pubsub_buffer_ref((t)->buffers, (m)->value))
+#define message_unref(t, m) do { if ((t)->buffers) pubsub_buffer_release((t)->buffers, (m)->value); } while (0)
+
+static bool pubsub_publish_internal(PubSubManager *mgr, int topic_id, 
                                     const PubSubMessage *message, bool forward_to_mqtt)
 {
     PubSubTopic *t;
-    unsigned int next_head;
+    unsigned char head;
     
-    if (!mgr || !topic || !message)
+    if (!message)
         return false;
     
-    t = pubsub_get_topic(mgr, topic);
+    t = topic_by_id(mgr, topic_id);
     
     if (!t)
         return false;  /* Topic doesn't exist */
     
-    _lock(&t->lock);
-    
-    /* Calculate next head position */
-    next_head = (t->queue_head + 1) % PUBSUB_MESSAGE_QUEUE_SIZE;
+    if (!topic_lock(t))
+        return false;
     
     /* Check if queue is full */
-    if (next_head == t->queue_tail) {
-        _unlock(&t->lock);
+    head = t->queue_head;
+    if ((unsigned char)(head - t->queue_tail) > t->queue_mask) {
+        topic_unlock(t);
         return false;  /* Queue is full */
     }
     
-    /* Add message to queue */
-    t->message_queue[t->queue_head] = *message;
-    t->queue_head = next_head;
+    if (!message_ref(t, message)) {
+        topic_unlock(t);
+        return false;  /* Buffer reference count saturated */
+    }
+    
+    /* Fill the slot before publishing it by advancing head */
+    t->message_queue[head & t->queue_mask] = *message;
+    t->queue_head = (unsigned char)(head + 1);
+    data_queued(t);
     
-    _unlock(&t->lock);
+    topic_unlock(t);
 
     /* Forward to MQTT if a transport is attached and this is a local publish */
     if (forward_to_mqtt && mgr->mqtt_enabled && mgr->mqtt.publish) {
-        mgr->mqtt.publish(topic, message, mgr->mqtt.ctx);
+        mgr->mqtt.publish(t->name, message, mgr->mqtt.ctx);
     }
 
     return true;
 }
 
+bool pubsub_publish_id(PubSubManager *mgr, int topic_id, const PubSubMessage *message)
+{
+    return pubsub_publish_internal(mgr, topic_id, message, true);
+}
+
 bool pubsub_publish(PubSubManager *mgr, const char *topic, const PubSubMessage *message)
 {
-    return pubsub_publish_internal(mgr, topic, message, true);
+    return pubsub_publish_internal(mgr, pubsub_topic_id(mgr, topic), message, true);
+}
+
+bool pubsub_publish_wait_id(PubSubManager *mgr, int topic_id, const PubSubMessage *message)
+{
+    PubSubTopic *t;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t || !message)
+        return false;
+    
+    /* Nothing yields between the fill check and parking, so a consumer
+     * cannot free space unseen. Taking the lock in publish may block,
+     * and another publisher may fill the ring meanwhile: check again.
+     * Any other failure (lock not taken, buffer at 255 holders) would
+     * fail the same way on every retry. */
+    for (;;) {
+        while ((unsigned char)(t->queue_head - t->queue_tail) >= t->high_water) {
+            if (scheduler_wait(&t->space) < 0)
+                return false;
+        }
+        if (pubsub_publish_internal(mgr, topic_id, message, true))
+            return true;
+        if ((unsigned char)(t->queue_head - t->queue_tail) < t->high_water)
+            return false;
+    }
+}
+
+bool pubsub_publish_wait(PubSubManager *mgr, const char *topic, const PubSubMessage *message)
+{
+    return pubsub_publish_wait_id(mgr, pubsub_topic_id(mgr, topic), message);
+}
+
+unsigned int pubsub_publish_batch_id(PubSubManager *mgr, int topic_id,
+                                     const PubSubMessage *messages, unsigned int count)
+{
+    PubSubTopic *t;
+    unsigned char head, slot, room;
+    unsigned int first, i;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t || !messages || t->payload)
+        return 0;  /* Payload slots would keep stale bytes: not supported */
+    
+    if (!topic_lock(t))
+        return 0;
+    
+    head = t->queue_head;
+    room = (unsigned char)(t->queue_mask + 1 - (unsigned char)(head - t->queue_tail));
+    if (count > room)
+        count = room;
+    
+    /* Copy in at most two runs: up to the end of the ring, then from slot 0 */
+    slot = head & t->queue_mask;
+    first = (unsigned int)(t->queue_mask + 1 - slot);
+    if (first > count)
+        first = count;
+    memcpy(&t->message_queue[slot], messages, first * sizeof(PubSubMessage));
+    memcpy(t->message_queue, messages + first, (count - first) * sizeof(PubSubMessage));
+    if (t->buffers) {
+        /* Stop at the first saturated buffer; the rest are not queued */
+        for (i = 0; i < count; i++) {
+            if (!pubsub_buffer_ref(t->buffers, messages[i].value))
+                break;
+        }
+        count = i;
+    }
+    t->queue_head = (unsigned char)(head + count);
+    if (count)
+        data_queued(t);
+    
+    topic_unlock(t);
+    
+    if (mgr->mqtt_enabled && mgr->mqtt.publish) {
+        for (i = 0; i < count; i++)
+            mgr->mqtt.publish(t->name, &messages[i], mgr->mqtt.ctx);
+    }
+    
+    return count;
+}
+
+unsigned int pubsub_publish_batch(PubSubManager *mgr, const char *topic,
+                                  const PubSubMessage *messages, unsigned int count)
+{
+    return pubsub_publish_batch_id(mgr, pubsub_topic_id(mgr, topic), messages, count);
+}
+
+PubSubMessage *pubsub_reserve_id(PubSubManager *mgr, int topic_id)
+{
+    PubSubTopic *t;
+    unsigned char head;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
+        return NULL;
+    
+    if (!topic_lock(t))
+        return NULL;
+    head = t->queue_head;
+    if ((unsigned char)(head - t->queue_tail) > t->queue_mask) {
+        topic_unlock(t);
+        return NULL;  /* Queue is full */
+    }
+    /* Lock is held until pubsub_commit */
+    if (t->payload)
+        t->message_queue[head & t->queue_mask].value =
+            t->payload + ((unsigned int)(head & t->queue_mask) << t->payload_shift);
+    return &t->message_queue[head & t->queue_mask];
+}
+
+PubSubMessage *pubsub_reserve(PubSubManager *mgr, const char *topic)
+{
+    return pubsub_reserve_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+bool pubsub_commit_id(PubSubManager *mgr, int topic_id)
+{
+    PubSubTopic *t;
+    unsigned char head;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
+        return false;
+    
+    head = t->queue_head;
+    if (!message_ref(t, &t->message_queue[head & t->queue_mask])) {
+        topic_unlock(t);
+        return false;  /* Dropped: buffer reference count saturated */
+    }
+    t->queue_head = (unsigned char)(head + 1);
+    data_queued(t);
+    
+    /* Forward while still locked: once unlocked, another publisher may
+     * reuse the slot as soon as it has been processed */
+    if (mgr->mqtt_enabled && mgr->mqtt.publish) {
+        mgr->mqtt.publish(t->name, &t->message_queue[head & t->queue_mask], mgr->mqtt.ctx);
+    }
+    
+    topic_unlock(t);
+    return true;
+}
+
+bool pubsub_commit(PubSubManager *mgr, const char *topic)
+{
+    return pubsub_commit_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+bool pubsub_publish_payload_id(PubSubManager *mgr, int topic_id, int key,
+                               const void *data, unsigned int len)
+{
+    PubSubTopic *t;
+    PubSubMessage *m;
+    unsigned char head, slot;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t || !t->payload || len > (1u << t->payload_shift) || (len && !data))
+        return false;
+    
+    if (!topic_lock(t))
+        return false;
+    
+    head = t->queue_head;
+    if ((unsigned char)(head - t->queue_tail) > t->queue_mask) {
+        topic_unlock(t);
+        return false;  /* Queue is full */
+    }
+    
+    slot = head & t->queue_mask;
+    m = &t->message_queue[slot];
+    m->key = key;
+    m->value = t->payload + ((unsigned int)slot << t->payload_shift);
+    memcpy(m->value, data, len);
+    t->queue_head = (unsigned char)(head + 1);
+    data_queued(t);
+    
+    /* Forward while locked, as in pubsub_commit */
+    if (mgr->mqtt_enabled && mgr->mqtt.publish) {
+        mgr->mqtt.publish(t->name, m, mgr->mqtt.ctx);
+    }
+    
+    topic_unlock(t);
+    return true;
+}
+
+bool pubsub_publish_payload(PubSubManager *mgr, const char *topic, int key,
+                            const void *data, unsigned int len)
+{
+    return pubsub_publish_payload_id(mgr, pubsub_topic_id(mgr, topic), key, data, len);
 }
 
 int pubsub_subscribe(PubSubManager *mgr, const char *topic, 
                      pubsub_callback_t callback, void *user_data)
 {
-    unsigned int i;
+    int topic_id;
     
-    if (!mgr || !topic || !callback || mgr->subscriber_count >= PUBSUB_MAX_SUBSCRIBERS)
+    if (!mgr || !topic || !callback)
         return -1;
     
     /* Ensure topic exists, create if it doesn't */
-    if (!pubsub_get_topic(mgr, topic)) {
-        if (pubsub_create_topic(mgr, topic) < 0)
-            return -1;
-    }
+    topic_id = pubsub_topic_id(mgr, topic);
+    if (topic_id < 0)
+        topic_id = pubsub_create_topic(mgr, topic);
+    return pubsub_subscribe_id(mgr, topic_id, callback, user_data);
+}
+
+/* Exactly one of callback and callback_batch is set */
+static int subscribe_internal(PubSubManager *mgr, int topic_id, pubsub_callback_t callback,
+                              pubsub_batch_callback_t callback_batch, void *user_data)
+{
+    PubSubTopic *t;
+    unsigned char *link;
+    unsigned int i;
     
-    _lock(&mgr->lock);
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
+        return -1;
+    
+    if (!_lock(&mgr->lock))
+        return -1;
     
     /* Find first available subscriber slot */
     for (i = 0; i < PUBSUB_MAX_SUBSCRIBERS; i++) {
         if (!mgr->subscribers[i].active) {
-            strncpy(mgr->subscribers[i].topic_name, topic, PUBSUB_MAX_TOPIC_NAME - 1);
-            mgr->subscribers[i].topic_name[PUBSUB_MAX_TOPIC_NAME - 1] = '\0';
+            mgr->subscribers[i].topic_id = topic_id;
             mgr->subscribers[i].callback = callback;
+            mgr->subscribers[i].callback_batch = callback_batch;
             mgr->subscribers[i].user_data = user_data;
             mgr->subscribers[i].active = true;
+            mgr->subscribers[i].next = PUBSUB_NO_SUBSCRIBER;
+            
+            /* Append to the topic's list so delivery follows subscribe order */
+            link = &t->first_subscriber;
+            while (*link != PUBSUB_NO_SUBSCRIBER)
+                link = &mgr->subscribers[*link].next;
+            *link = (unsigned char)i;
             
             if (i >= mgr->subscriber_count)
                 mgr->subscriber_count = i + 1;
@@ -183,17 +571,57 @@ int pubsub_subscribe(PubSubManager *mgr, const char *topic,
     return -1;  /* No available subscriber slots */
 }
 
+int pubsub_subscribe_id(PubSubManager *mgr, int topic_id,
+                        pubsub_callback_t callback, void *user_data)
+{
+    if (!callback)
+        return -1;
+    return subscribe_internal(mgr, topic_id, callback, NULL, user_data);
+}
+
+int pubsub_subscribe_batch_id(PubSubManager *mgr, int topic_id,
+                              pubsub_batch_callback_t callback, void *user_data)
+{
+    if (!callback)
+        return -1;
+    return subscribe_internal(mgr, topic_id, NULL, callback, user_data);
+}
+
+int pubsub_subscribe_batch(PubSubManager *mgr, const char *topic,
+                           pubsub_batch_callback_t callback, void *user_data)
+{
+    int topic_id;
+    
+    if (!mgr || !topic || !callback)
+        return -1;
+    
+    topic_id = pubsub_topic_id(mgr, topic);
+    if (topic_id < 0)
+        topic_id = pubsub_create_topic(mgr, topic);
+    return pubsub_subscribe_batch_id(mgr, topic_id, callback, user_data);
+}
+
 bool pubsub_unsubscribe(PubSubManager *mgr, int subscriber_id)
 {
     if (!mgr || subscriber_id < 0 || subscriber_id >= PUBSUB_MAX_SUBSCRIBERS)
         return false;
     
-    _lock(&mgr->lock);
+    if (!_lock(&mgr->lock))
+        return false;
     
     if (mgr->subscribers[subscriber_id].active) {
+        PubSubTopic *t = &mgr->topics[mgr->subscribers[subscriber_id].topic_id];
+        unsigned char *link = &t->first_subscriber;
+        
+        /* Unlink; `next` is left intact so a dispatch loop standing on
+         * this subscriber can still move on */
+        while (*link != (unsigned char)subscriber_id)
+            link = &mgr->subscribers[*link].next;
+        *link = mgr->subscribers[subscriber_id].next;
         mgr->subscribers[subscriber_id].active = false;
         mgr->subscribers[subscriber_id].callback = NULL;
-        mgr->subscribers[subscriber_id].topic_name[0] = '\0';
+        mgr->subscribers[subscriber_id].callback_batch = NULL;
+        mgr->subscribers[subscriber_id].topic_id = -1;
         
         _unlock(&mgr->lock);
         return true;
@@ -204,44 +632,175 @@ bool pubsub_unsubscribe(PubSubManager *mgr, int subscriber_id)
 }
 
 /* Process all pending messages for a specific topic */
-void pubsub_process_topic(PubSubManager *mgr, const char *topic)
+void pubsub_process_id(PubSubManager *mgr, int topic_id)
 {
     PubSubTopic *t;
-    unsigned int i;
-    PubSubMessage message;
+    PubSubSubscriber *sub;
+    const PubSubMessage *run;
+    unsigned char i, tail, count, n, k;
     
-    if (!mgr || !topic)
-        return;
-    
-    t = pubsub_get_topic(mgr, topic);
+    t = topic_by_id(mgr, topic_id);
 
     if (!t)
         return;
     
-    _lock(&t->lock);
-    
-    /* Process all messages in the queue */
-    while (t->queue_tail != t->queue_head) {
-        message = t->message_queue[t->queue_tail];
-        t->queue_tail = (t->queue_tail + 1) % PUBSUB_MESSAGE_QUEUE_SIZE;
+    if (!topic_lock(t))
+        return;
+    if (t->draining) {
+        topic_unlock(t);
+        return;
+    }
+    t->draining = 1;
+    
+    /* Deliver the queue one contiguous run at a time. The run stays in the
+     * ring while subscribers read it: tail only moves past it afterwards,
+     * so the publisher cannot reuse those slots yet. */
+    for (;;) {
+        tail = t->queue_tail;
+        count = (unsigned char)(t->queue_head - tail);
+        if (count == 0)
+            break;
+        n = (unsigned char)(t->queue_mask + 1 - (tail & t->queue_mask));
+        if (count > n)
+            count = n;
+        run = &t->message_queue[tail & t->queue_mask];
         
-        _unlock(&t->lock);
+        topic_unlock(t);
         
-        /* Call all subscribers for this topic */
-        for (i = 0; i < PUBSUB_MAX_SUBSCRIBERS; i++) {
-            if (mgr->subscribers[i].active && 
-                strcmp(mgr->subscribers[i].topic_name, topic) == 0) {
-                if (mgr->subscribers[i].callback) {
-                    mgr->subscribers[i].callback(topic, &message, 
-                                                 mgr->subscribers[i].user_data);
-                }
+        /* Call all subscribers for this topic; read `next` after the
+         * callback, which may unsubscribe itself */
+        for (i = t->first_subscriber; i != PUBSUB_NO_SUBSCRIBER; i = sub->next) {
+            sub = &mgr->subscribers[i];
+            if (sub->callback_batch) {
+                if (sub->active)
+                    sub->callback_batch(t->name, run, count, sub->user_data);
+            } else {
+                for (k = 0; k < count && sub->active && sub->callback; k++)
+                    sub->callback(t->name, &run[k], sub->user_data);
             }
         }
         
-        _lock(&t->lock);
+        if (!topic_lock(t)) {
+            /* The run stays queued and is delivered again next time */
+            t->draining = 0;
+            return;
+        }
+        /* A clear while unlocked already moved tail past this run and
+         * dropped its buffer references */
+        if (t->queue_tail == tail) {
+            if (t->buffers) {
+                for (k = 0; k < count; k++)
+                    pubsub_buffer_release(t->buffers, run[k].value);
+            }
+            t->queue_tail = (unsigned char)(tail + count);
+        }
+        space_freed(t);
+    }
+    
+    t->draining = 0;
+    topic_unlock(t);
+}
+
+void pubsub_process_topic(PubSubManager *mgr, const char *topic)
+{
+    pubsub_process_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+int pubsub_wait_id(PubSubManager *mgr, int topic_id)
+{
+    PubSubTopic *t;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
+        return -1;
+    
+    /* No yield between the check and parking: a publish cannot slip by */
+    while (t->queue_head == t->queue_tail) {
+        if (scheduler_wait(&t->readers) < 0)
+            return -1;
     }
+    return 0;
+}
+
+int pubsub_wait(PubSubManager *mgr, const char *topic)
+{
+    return pubsub_wait_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+/* Body of the tasks started by pubsub_start_consumer */
+static void consumer_task(void *arg)
+{
+    PubSubTopic *t = (PubSubTopic *)arg;
+    int topic_id = (int)(t - t->mgr->topics);
+    
+    while (pubsub_wait_id(t->mgr, topic_id) == 0)
+        pubsub_process_id(t->mgr, topic_id);
+    t->consumer = PUBSUB_NO_CONSUMER;
+}
+
+int pubsub_start_consumer_id(PubSubManager *mgr, int topic_id, unsigned char prio)
+{
+    PubSubTopic *t;
+    int task;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t || t->consumer != PUBSUB_NO_CONSUMER)
+        return -1;
+    
+    task = scheduler_add_prio(consumer_task, t, prio);
+    if (task < 0)
+        return -1;
+    t->consumer = (unsigned char)task;
+    return task;
+}
+
+int pubsub_start_consumer(PubSubManager *mgr, const char *topic, unsigned char prio)
+{
+    return pubsub_start_consumer_id(mgr, pubsub_topic_id(mgr, topic), prio);
+}
+
+const PubSubMessage *pubsub_peek_id(PubSubManager *mgr, int topic_id)
+{
+    PubSubTopic *t;
+    unsigned char tail;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
+        return NULL;
+    
+    /* Only the caller moves tail, so the slot stays put until release */
+    tail = t->queue_tail;
+    if (tail == t->queue_head)
+        return NULL;
+    return &t->message_queue[tail & t->queue_mask];
+}
+
+const PubSubMessage *pubsub_peek(PubSubManager *mgr, const char *topic)
+{
+    return pubsub_peek_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+void pubsub_release_id(PubSubManager *mgr, int topic_id)
+{
+    PubSubTopic *t;
+    
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
+        return;
     
-    _unlock(&t->lock);
+    if (!topic_lock(t))
+        return;
+    if (t->queue_tail != t->queue_head) {
+        message_unref(t, &t->message_queue[t->queue_tail & t->queue_mask]);
+        ++t->queue_tail;
+        space_freed(t);
+    }
+    topic_unlock(t);
+}
+
+void pubsub_release(PubSubManager *mgr, const char *topic)
+{
+    pubsub_release_id(mgr, pubsub_topic_id(mgr, topic));
 }
 
 /* Process all pending messages for all topics */
@@ -252,73 +811,184 @@ void pubsub_process_all(PubSubManager *mgr)
     if (!mgr)
         return;
     
+    /* head != tail is the topic's dirty flag: it needs no upkeep and
+     * stays right even with an interrupt publishing to an SPSC topic */
     for (i = 0; i < mgr->topic_count; i++) {
-        pubsub_process_topic(mgr, mgr->topics[i].name);
+        if (mgr->topics[i].queue_head != mgr->topics[i].queue_tail)
+            pubsub_process_id(mgr, (int)i);
     }
 }
 
-unsigned int pubsub_queue_size(PubSubManager *mgr, const char *topic)
+unsigned int pubsub_queue_size_id(PubSubManager *mgr, int topic_id)
 {
     PubSubTopic *t;
     unsigned int size;
     
-    if (!mgr || !topic)
-        return 0;
-    
-    t = pubsub_get_topic(mgr, topic);
+    t = topic_by_id(mgr, topic_id);
     if (!t)
         return 0;
     
-    _lock(&t->lock);
-    
-    if (t->queue_head >= t->queue_tail) {
-        size = t->queue_head - t->queue_tail;
-    } else {
-        size = PUBSUB_MESSAGE_QUEUE_SIZE - (t->queue_tail - t->queue_head);
-    }
-    
-    _unlock(&t->lock);
+    if (!topic_lock(t))
+        return 0;
+    size = (unsigned char)(t->queue_head - t->queue_tail);
+    topic_unlock(t);
     return size;
 }
 
-unsigned int pubsub_subscriber_count(PubSubManager *mgr, const char *topic)
+unsigned int pubsub_queue_size(PubSubManager *mgr, const char *topic)
+{
+    return pubsub_queue_size_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+unsigned int pubsub_subscriber_count_id(PubSubManager *mgr, int topic_id)
 {
-    unsigned int i, count = 0;
+    PubSubTopic *t;
+    unsigned char i;
+    unsigned int count = 0;
     
-    if (!mgr || !topic)
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
         return 0;
     
-    for (i = 0; i < PUBSUB_MAX_SUBSCRIBERS; i++) {
-        if (mgr->subscribers[i].active && 
-            strcmp(mgr->subscribers[i].topic_name, topic) == 0) {
-            count++;
-        }
-    }
+    for (i = t->first_subscriber; i != PUBSUB_NO_SUBSCRIBER; i = mgr->subscribers[i].next)
+        count++;
     
     return count;
 }
 
-void pubsub_clear_queue(PubSubManager *mgr, const char *topic)
+unsigned int pubsub_subscriber_count(PubSubManager *mgr, const char *topic)
+{
+    return pubsub_subscriber_count_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+void pubsub_clear_queue_id(PubSubManager *mgr, int topic_id)
 {
     PubSubTopic *t;
+    unsigned char head, tail;
     
-    if (!mgr || !topic)
+    t = topic_by_id(mgr, topic_id);
+    if (!t)
         return;
     
-    t = pubsub_get_topic(mgr, topic);
-    if (!t)
+    /* Drop by catching tail up, so an SPSC publisher's head is untouched */
+    if (!topic_lock(t))
         return;
+    head = t->queue_head;
+    if (t->buffers) {
+        for (tail = t->queue_tail; tail != head; tail++)
+            pubsub_buffer_release(t->buffers, t->message_queue[tail & t->queue_mask].value);
+    }
+    t->queue_tail = head;
+    scheduler_wake_all(&t->space);
+    topic_unlock(t);
+}
+
+void pubsub_clear_queue(PubSubManager *mgr, const char *topic)
+{
+    pubsub_clear_queue_id(mgr, pubsub_topic_id(mgr, topic));
+}
+
+unsigned int pubsub_memory_usage(const PubSubManager *mgr)
+{
+    if (!mgr)
+        return 0;
+    return (unsigned int)(sizeof(*mgr) -
+                          (PUBSUB_POOL_MESSAGES - mgr->pool_used) * sizeof(PubSubMessage) +
+                          mgr->external_bytes);
+}
+
+bool pubsub_buffers_init(PubSubBufferPool *pool, void *storage,
+                         unsigned int size, unsigned char count)
+{
+    unsigned char i;
+    unsigned char shift = pow2_shift(size);
+    
+    if (!pool || !storage || shift == 0xFF || count > PUBSUB_MAX_BUFFERS)
+        return false;
+    
+    pool->storage = (unsigned char *)storage;
+    pool->shift = shift;
+    pool->count = count;
+    for (i = 0; i < PUBSUB_MAX_BUFFERS; i++)
+        pool->refs[i] = 0;
+    return true;
+}
+
+/* Index of the pool buffer starting at `buffer`, or -1 */
+static int buffer_index(const PubSubBufferPool *pool, const void *buffer)
+{
+    const unsigned char *p = (const unsigned char *)buffer;
+    unsigned int offset;
     
-    _lock(&t->lock);
-    t->queue_head = 0;
-    t->queue_tail = 0;
-    _unlock(&t->lock);
+    if (!pool || p < pool->storage)
+        return -1;
+    offset = (unsigned int)(p - pool->storage);
+    if ((offset & ((1u << pool->shift) - 1)) != 0)
+        return -1;
+    offset >>= pool->shift;
+    return offset < pool->count ? (int)offset : -1;
+}
+
+void *pubsub_buffer_alloc(PubSubBufferPool *pool)
+{
+    unsigned char i;
+    
+    if (!pool)
+        return NULL;
+    for (i = 0; i < pool->count; i++) {
+        if (pool->refs[i] == 0) {
+            pool->refs[i] = 1;
+            return pool->storage + ((unsigned int)i << pool->shift);
+        }
+    }
+    return NULL;
+}
+
+bool pubsub_buffer_ref(PubSubBufferPool *pool, const void *buffer)
+{
+    int i = buffer_index(pool, buffer);
+    if (i < 0)
+        return true;   /* Not a pool buffer: nothing to count */
+    if (pool->refs[i] == 0xFF)
+        return false;  /* 255 holders: one more could not be released */
+    pool->refs[i]++;
+    return true;
+}
+
+void pubsub_buffer_release(PubSubBufferPool *pool, const void *buffer)
+{
+    int i = buffer_index(pool, buffer);
+    if (i >= 0 && pool->refs[i] != 0)
+        pool->refs[i]--;
+}
+
+unsigned char pubsub_buffers_available(const PubSubBufferPool *pool)
+{
+    unsigned char i, n = 0;
+    
+    if (!pool)
+        return 0;
+    for (i = 0; i < pool->count; i++) {
+        if (pool->refs[i] == 0)
+            n++;
+    }
+    return n;
+}
+
+bool pubsub_lock(PubSubManager *mgr)
+{
+    return mgr && _lock(&mgr->lock);
+}
+
+void pubsub_unlock(PubSubManager *mgr)
+{
+    if (mgr) _unlock(&mgr->lock);
 }
 
 bool pubsub_publish_from_external(PubSubManager *mgr, const char *topic, const PubSubMessage *message)
 {
     /* Skip MQTT forwarding to avoid loops */
-    return pubsub_publish_internal(mgr, topic, message, false);
+    return pubsub_publish_internal(mgr, pubsub_topic_id(mgr, topic), message, false);
 }
 
 void pubsub_set_mqtt_adapter(PubSubManager *mgr, const PubSubMqttAdapter *adapter)
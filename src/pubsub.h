@@ -14,7 +14,64 @@
 #define PUBSUB_MAX_TOPICS 16
 #define PUBSUB_MAX_SUBSCRIBERS 32
 #define PUBSUB_MAX_TOPIC_NAME 32
-#define PUBSUB_MESSAGE_QUEUE_SIZE 64
+/* Topic rings hold a power of two of messages, up to 128, so the
+ * free-running 8-bit head and tail wrap with a mask and a full ring
+ * (head - tail == depth) stays distinguishable from an empty one.
+ * PUBSUB_MESSAGE_QUEUE_SIZE is the depth pubsub_create_topic uses.
+ */
+#define PUBSUB_MAX_QUEUE_DEPTH 128
+
+#ifndef PUBSUB_MESSAGE_QUEUE_SIZE
+#define PUBSUB_MESSAGE_QUEUE_SIZE 16
+#endif
+
+#if PUBSUB_MESSAGE_QUEUE_SIZE < 2 || PUBSUB_MESSAGE_QUEUE_SIZE > PUBSUB_MAX_QUEUE_DEPTH || \
+    (PUBSUB_MESSAGE_QUEUE_SIZE & (PUBSUB_MESSAGE_QUEUE_SIZE - 1)) != 0
+#error "PUBSUB_MESSAGE_QUEUE_SIZE must be a power of two between 2 and 128"
+#endif
+
+/* Messages in the manager's shared pool; topic rings are carved from it
+ * as topics are created and are never returned (pubsub_init resets it).
+ * The default fits every topic at the default depth. */
+#ifndef PUBSUB_POOL_MESSAGES
+#define PUBSUB_POOL_MESSAGES 256
+#endif
+
+/* Largest inline payload per ring slot, in bytes (a power of two) */
+#define PUBSUB_MAX_PAYLOAD 128
+
+/* Buffers per PubSubBufferPool (one reference count byte each) */
+#ifndef PUBSUB_MAX_BUFFERS
+#define PUBSUB_MAX_BUFFERS 16
+#endif
+
+/* Topic and manager locks are scheduler mutexes: a task that finds one
+ * held blocks until it is released instead of spinning. Define
+ * PUBSUB_LOCKING 0 when a single task owns the manager to compile the
+ * locks out entirely.
+ *
+ * A lock that cannot be taken makes the call fail without touching the
+ * topic: publish and unsubscribe return false, the id/count calls 0 or -1,
+ * reserve NULL, and process/release/clear do nothing. That happens on
+ * re-entry by the task already holding the lock (e.g. publishing to a
+ * topic between its own reserve and commit, or subscribing between
+ * pubsub_lock and pubsub_unlock), on a deadlock, and when code outside any task
+ * (before scheduler_run, or an interrupt) finds a task holding the lock,
+ * since it cannot block. Only SPSC topics, which take no lock, may be
+ * published to from outside a task while tasks are running.
+ */
+#ifndef PUBSUB_LOCKING
+#define PUBSUB_LOCKING 1
+#endif
+
+/* Blocking publish parks tasks on scheduler wait queues */
+#include "scheduler.h"
+
+#if PUBSUB_LOCKING
+typedef scheduler_mutex_t pubsub_lock_t;
+#else
+typedef unsigned char pubsub_lock_t; /* unused */
+#endif
 
 /* Key/value message structure */
 typedef struct {
@@ -25,6 +82,11 @@ typedef struct {
 /* Subscriber callback function type */
 typedef void (*pubsub_callback_t)(const char *topic, const PubSubMessage *message, void *user_data);
 
+/* Batch subscriber: called once per run of `count` consecutive messages.
+ * The span points into the topic ring and is only valid during the call. */
+typedef void (*pubsub_batch_callback_t)(const char *topic, const PubSubMessage *messages,
+                                        unsigned int count, void *user_data);
+
 /* Optional MQTT bridge callbacks */
 typedef bool (*pubsub_mqtt_publish_fn)(const char *topic, const PubSubMessage *message, void *ctx);
 typedef bool (*pubsub_mqtt_poll_fn)(char *topic_out, unsigned int topic_buf_len,
@@ -36,37 +98,78 @@ typedef struct {
     void *ctx;                      /* Transport context (e.g., RIA handle) */
 } PubSubMqttAdapter;
 
+/* Fixed-size, reference-counted buffers for payloads too large to inline.
+ * A buffer published on a topic attached to the pool is held by the queued
+ * message until every subscriber has seen it, so the producer can drop its
+ * own reference right after publishing. Subscribers that keep the buffer
+ * take a reference of their own. */
+typedef struct {
+    unsigned char *storage;         /* count buffers of 1 << shift bytes */
+    unsigned char shift;
+    unsigned char count;
+    unsigned char refs[PUBSUB_MAX_BUFFERS]; /* 0 = free */
+} PubSubBufferPool;
+
+typedef struct PubSubManager PubSubManager;
+
+/* PubSubTopic.consumer when no consumer task is bound */
+#define PUBSUB_NO_CONSUMER 0xFF
+
+/* End of a topic's subscriber list */
+#define PUBSUB_NO_SUBSCRIBER 0xFF
+
 /* Topic structure */
 typedef struct {
     char name[PUBSUB_MAX_TOPIC_NAME];
-    PubSubMessage message_queue[PUBSUB_MESSAGE_QUEUE_SIZE];
-    unsigned int queue_head;
-    unsigned int queue_tail;
-    volatile unsigned int lock;
+    PubSubMessage *message_queue;   /* queue_mask + 1 slots */
+    unsigned char queue_mask;
+    /* Free-running indices; slot = index & queue_mask. Only the
+     * publisher advances head and only the processor advances tail. */
+    volatile unsigned char queue_head;
+    volatile unsigned char queue_tail;
+    unsigned char spsc;             /* lock-free single producer/consumer */
+    unsigned char draining;         /* a task is delivering this ring */
+    unsigned char *payload;         /* inline payload slots, or NULL */
+    unsigned char payload_shift;    /* slot size is 1 << payload_shift */
+    PubSubBufferPool *buffers;      /* pool whose buffers queued messages hold */
+    unsigned char high_water;       /* pubsub_publish_wait blocks at this fill */
+    unsigned char low_water;        /* ...and resumes once drained to this */
+    scheduler_waitq_t space;        /* publishers blocked on high_water */
+    scheduler_waitq_t readers;      /* consumers blocked in pubsub_wait */
+    unsigned char consumer;         /* task started by pubsub_start_consumer */
+    PubSubManager *mgr;             /* owner, for the consumer task */
+    pubsub_lock_t lock;
+    unsigned char first_subscriber; /* head of this topic's subscriber list */
 } PubSubTopic;
 
 /* Subscriber structure */
 typedef struct {
-    char topic_name[PUBSUB_MAX_TOPIC_NAME];
+    int topic_id;      /* index into PubSubManager.topics */
     pubsub_callback_t callback;
+    pubsub_batch_callback_t callback_batch; /* used instead when set */
     void *user_data;
     bool active;
+    unsigned char next; /* next subscriber of the same topic */
 } PubSubSubscriber;
 
 /* Pub/Sub manager structure */
-typedef struct {
+struct PubSubManager {
     PubSubTopic topics[PUBSUB_MAX_TOPICS];
     unsigned int topic_count;
     
     PubSubSubscriber subscribers[PUBSUB_MAX_SUBSCRIBERS];
     unsigned int subscriber_count;
     
-    volatile unsigned int lock;
+    PubSubMessage pool[PUBSUB_POOL_MESSAGES];
+    unsigned int pool_used;         /* messages handed out to topics */
+    unsigned int external_bytes;    /* caller-supplied ring buffers */
+    
+    pubsub_lock_t lock;
 
     /* Optional MQTT bridge */
     PubSubMqttAdapter mqtt;
     bool mqtt_enabled;
-} PubSubManager;
+};
 
 /* Initialize the pub/sub system */
 void pubsub_init(PubSubManager *mgr);
@@ -74,9 +177,63 @@ void pubsub_init(PubSubManager *mgr);
 /* Create a new topic */
 int pubsub_create_topic(PubSubManager *mgr, const char *topic_name);
 
+/* Topic options for pubsub_create_topic_ex */
+typedef struct {
+    unsigned char depth;   /* ring size; rounded up to a power of two,
+                              0 = PUBSUB_MESSAGE_QUEUE_SIZE */
+    PubSubMessage *buffer; /* caller's ring of exactly `depth` messages
+                              (depth must then be a power of two), or
+                              NULL to carve it from the manager's pool */
+    unsigned char spsc;    /* see pubsub_create_topic_spsc */
+    unsigned char payload_size;     /* inline bytes per slot: 0 or a power
+                                       of two up to PUBSUB_MAX_PAYLOAD */
+    unsigned char *payload_buffer;  /* caller's depth * payload_size bytes,
+                                       or NULL to carve from the pool */
+    PubSubBufferPool *buffers;      /* reference pool buffers while queued */
+    unsigned char high_water;       /* pubsub_publish_wait watermarks, with */
+    unsigned char low_water;        /* low < high <= depth; 0 = depth and
+                                       depth / 2 respectively */
+} PubSubTopicConfig;
+
+/* Fill a config with the pubsub_create_topic defaults */
+void pubsub_topic_config_init(PubSubTopicConfig *config);
+
+/* Create a topic with the given options; -1 if the table or pool is full
+ * or the options are invalid. Returns the existing id, unchanged, if the
+ * topic already exists. */
+int pubsub_create_topic_ex(PubSubManager *mgr, const char *topic_name,
+                           const PubSubTopicConfig *config);
+
+/* Create a topic with a single publisher and a single processing task.
+ * Publish and process skip the topic lock entirely; each side only writes
+ * its own ring index, so the publisher may also be an interrupt handler.
+ * Returns the existing id, unchanged, if the topic already exists. */
+int pubsub_create_topic_spsc(PubSubManager *mgr, const char *topic_name);
+
 /* Publish a message to a topic */
 bool pubsub_publish(PubSubManager *mgr, const char *topic, const PubSubMessage *message);
 
+/* Publish from a task, blocking while the topic holds high_water or more
+ * messages; processing wakes blocked publishers once the queue has drained
+ * to low_water. Returns false for a bad topic, when no other task could
+ * ever drain it, when the topic lock cannot be taken (see PUBSUB_LOCKING)
+ * and when a pool buffer already has 255 holders. Not for interrupt
+ * handlers. */
+bool pubsub_publish_wait(PubSubManager *mgr, const char *topic, const PubSubMessage *message);
+bool pubsub_publish_wait_id(PubSubManager *mgr, int topic_id, const PubSubMessage *message);
+
+/* Event-driven dispatch. pubsub_wait blocks the calling task until the
+ * topic has a message queued; every publish wakes tasks waiting on it.
+ * pubsub_start_consumer adds a task at `prio` that waits on the topic and
+ * processes it, so subscribers run as soon as the publisher yields
+ * instead of at the next polling round (one consumer per topic; -1 if
+ * the topic already has one or no task slot is free; else the task id).
+ * Neither may be used on a topic published from an interrupt handler. */
+int pubsub_wait(PubSubManager *mgr, const char *topic);
+int pubsub_wait_id(PubSubManager *mgr, int topic_id);
+int pubsub_start_consumer(PubSubManager *mgr, const char *topic, unsigned char prio);
+int pubsub_start_consumer_id(PubSubManager *mgr, int topic_id, unsigned char prio);
+
 /* Subscribe to a topic with a callback function */
 int pubsub_subscribe(PubSubManager *mgr, const char *topic, 
                      pubsub_callback_t callback, void *user_data);
@@ -84,15 +241,92 @@ int pubsub_subscribe(PubSubManager *mgr, const char *topic,
 /* Unsubscribe from a topic */
 bool pubsub_unsubscribe(PubSubManager *mgr, int subscriber_id);
 
-/* Process all pending messages for all topics */
+/* Process all pending messages for all topics. Topics whose ring is
+ * empty are skipped without taking their lock. */
 void pubsub_process_all(PubSubManager *mgr);
 
-/* Process pending messages for a specific topic */
+/* Process pending messages for a specific topic. Messages are handed out
+ * in contiguous runs of the ring: each subscriber, in subscribe order, sees
+ * the whole run before the next one does. One task drains a topic at a
+ * time; a second caller (or a callback re-entering) returns at once. */
 void pubsub_process_topic(PubSubManager *mgr, const char *topic);
 
 /* Get topic by name */
 PubSubTopic* pubsub_get_topic(PubSubManager *mgr, const char *topic);
 
+/* Topic handles: resolve a name once with pubsub_topic_id (or keep the
+ * value returned by pubsub_create_topic) and use the _id calls on the hot
+ * path; they index the topic table directly instead of comparing names.
+ * The name-based calls above and below are wrappers around these.
+ */
+int pubsub_topic_id(PubSubManager *mgr, const char *topic);
+bool pubsub_publish_id(PubSubManager *mgr, int topic_id, const PubSubMessage *message);
+int pubsub_subscribe_id(PubSubManager *mgr, int topic_id,
+                        pubsub_callback_t callback, void *user_data);
+void pubsub_process_id(PubSubManager *mgr, int topic_id);
+unsigned int pubsub_subscriber_count_id(PubSubManager *mgr, int topic_id);
+unsigned int pubsub_queue_size_id(PubSubManager *mgr, int topic_id);
+void pubsub_clear_queue_id(PubSubManager *mgr, int topic_id);
+
+/* Batches: publish up to `count` messages under one lock and return how
+ * many fit in the ring (the rest are not queued). Payload topics do not
+ * take batches (0 is returned): use pubsub_publish_payload per message.
+ * A batch subscriber gets each contiguous run of queued messages in a
+ * single call. */
+unsigned int pubsub_publish_batch(PubSubManager *mgr, const char *topic,
+                                  const PubSubMessage *messages, unsigned int count);
+unsigned int pubsub_publish_batch_id(PubSubManager *mgr, int topic_id,
+                                     const PubSubMessage *messages, unsigned int count);
+int pubsub_subscribe_batch(PubSubManager *mgr, const char *topic,
+                           pubsub_batch_callback_t callback, void *user_data);
+int pubsub_subscribe_batch_id(PubSubManager *mgr, int topic_id,
+                              pubsub_batch_callback_t callback, void *user_data);
+
+/* Zero-copy publish: pubsub_reserve returns the next free ring slot (NULL
+ * if the ring is full) for the caller to fill, and pubsub_commit queues
+ * it. The topic stays locked in between, so every successful reserve must
+ * be committed, without yielding in between. pubsub_commit returns false,
+ * dropping the message, if its value is a pool buffer that already has
+ * 255 references. */
+PubSubMessage *pubsub_reserve(PubSubManager *mgr, const char *topic);
+PubSubMessage *pubsub_reserve_id(PubSubManager *mgr, int topic_id);
+bool pubsub_commit(PubSubManager *mgr, const char *topic);
+bool pubsub_commit_id(PubSubManager *mgr, int topic_id);
+
+/* Inline payloads: copy `len` bytes (at most the topic's payload_size)
+ * into the next ring slot and queue it with value pointing at the copy.
+ * The copy is valid until the message has been processed, so the caller
+ * may reuse `data` at once. Bytes past `len` keep whatever the slot held.
+ * On a payload topic pubsub_reserve also points value at the slot's
+ * payload, to be written in place. */
+bool pubsub_publish_payload(PubSubManager *mgr, const char *topic, int key,
+                            const void *data, unsigned int len);
+bool pubsub_publish_payload_id(PubSubManager *mgr, int topic_id, int key,
+                               const void *data, unsigned int len);
+
+/* Buffer pools: `size` must be a power of two and storage hold count *
+ * size bytes. alloc returns a buffer with one reference (NULL if none is
+ * free). ref and release ignore pointers that are not pool buffers, so a
+ * pool topic can still carry plain values. A buffer has at most 255
+ * holders (one count byte each): ref returns false at that limit, and a
+ * publish whose buffer cannot take another reference fails (batch
+ * publish stops before it). */
+bool pubsub_buffers_init(PubSubBufferPool *pool, void *storage,
+                         unsigned int size, unsigned char count);
+void *pubsub_buffer_alloc(PubSubBufferPool *pool);
+bool pubsub_buffer_ref(PubSubBufferPool *pool, const void *buffer);
+void pubsub_buffer_release(PubSubBufferPool *pool, const void *buffer);
+unsigned char pubsub_buffers_available(const PubSubBufferPool *pool);
+
+/* Zero-copy consume, bypassing subscribers: pubsub_peek returns the oldest
+ * queued message in place (NULL if empty); it stays valid until
+ * pubsub_release drops it. Only the task that processes a topic may use
+ * these on it. */
+const PubSubMessage *pubsub_peek(PubSubManager *mgr, const char *topic);
+const PubSubMessage *pubsub_peek_id(PubSubManager *mgr, int topic_id);
+void pubsub_release(PubSubManager *mgr, const char *topic);
+void pubsub_release_id(PubSubManager *mgr, int topic_id);
+
 /* Get number of active subscribers for a topic */
 unsigned int pubsub_subscriber_count(PubSubManager *mgr, const char *topic);
 
@@ -102,10 +336,15 @@ unsigned int pubsub_queue_size(PubSubManager *mgr, const char *topic);
 /* Clear all messages in a topic's queue */
 void pubsub_clear_queue(PubSubManager *mgr, const char *topic);
 
-/* Lock/unlock for thread-safe operations */
-void pubsub_lock(PubSubManager *mgr);
+/* Hold the manager lock across several calls (may block under contention).
+ * Returns false if it could not be taken; do not call pubsub_unlock then. */
+bool pubsub_lock(PubSubManager *mgr);
 void pubsub_unlock(PubSubManager *mgr);
 
+/* Bytes actually in use: the manager without its unused pool, plus
+ * caller-supplied ring buffers. sizeof(PubSubManager) is the reservation. */
+unsigned int pubsub_memory_usage(const PubSubManager *mgr);
+
 /* MQTT bridge control */
 void pubsub_set_mqtt_adapter(PubSubManager *mgr, const PubSubMqttAdapter *adapter);
 bool pubsub_publish_from_external(PubSubManager *mgr, const char *topic, const PubSubMessage *message);
@@ -1,22 +1,15 @@
 /* scheduler.c - stackful cooperative scheduler using stack-copying context switch
+ *
+ * Strict priority with round-robin inside a level; see the run-state notes
+ * below.
  */
 #include "scheduler.h"
-
-/* Task structure layout must match offsets used in ctxswitch.s */
-typedef struct {
-    scheduler_task_fn fn;   /* 0..1 */
-    void *arg;              /* 2..3 */
-    unsigned char in_use;   /* 4 */
-    unsigned char one_shot; /* 5 */
-    unsigned char started;  /* 6 */
-    unsigned char saved_sp; /* 7 */
-    unsigned char a;        /* 8 */
-    unsigned char x;        /* 9 */
-    unsigned char y;        /* 10 */
-    unsigned char p;        /* 11 */
-    unsigned short wake_tick; /* 12..13 */
-    unsigned char stack[SCHED_TASK_STACK_SIZE]; /* 14.. */
-} task_t;
+#include "scheduler_task.h"
+#if SCHED_TICK_SOURCE == SCHED_TICK_VSYNC
+#include <rp6502.h>
+#elif SCHED_TICK_SOURCE == SCHED_TICK_CLOCK
+#include <time.h>
+#endif
 
 static task_t tasks[SCHED_MAX_TASKS];
 static task_t scheduler_ctx; /* used to hold scheduler/main context */
@@ -24,9 +17,49 @@ static task_t scheduler_ctx; /* used to hold scheduler/main context */
 /* Per-task max observed stack usage (bytes) - tracked at runtime */
 static unsigned int task_max_stack[SCHED_MAX_TASKS];
 
+/* Per-task cc65 C stacks; the runtime's sp is switched by ctxswitch.s */
+static unsigned char task_cstacks[SCHED_MAX_TASKS][SCHED_TASK_CSTACK_SIZE];
+
 /* Pointers referenced by assembly */
 void *ctx_cur = 0;
 void *ctx_next = 0;
+/* Lowest page 1 offset task_t.stack[] can hold; ctxswitch.s clamps its copies to it */
+const unsigned char ctx_stack_floor = (unsigned char)(256 - SCHED_TASK_STACK_SIZE);
+
+/* Run-state bookkeeping (C only, not touched by ctxswitch.s).
+ * Ready tasks sit in one FIFO per priority level, linked through
+ * ready_next[], with ready_levels marking the non-empty levels; picking the
+ * next task dequeues from the highest non-empty level. A level skipped
+ * SCHED_PRIO_AGING times has its head promoted one level, so lower levels
+ * cannot starve. Blocked tasks sit on the wait queue they block on,
+ * linked through wait_next[]. Sleepers sit in a delta queue linked through
+ * sleep_next[], ordered by wakeup, each wake_delta counting ticks after the
+ * sleeper before it, so a tick only decrements the head. The idle task is
+ * never queued: it runs only when the ready FIFO is empty.
+ */
+#define TASK_NONE 0xFF
+#define TASK_FREE 0
+#define TASK_READY 1
+#define TASK_RUNNING 2
+#define TASK_SLEEPING 3
+#define TASK_BLOCKED 4
+
+static unsigned char task_state[SCHED_MAX_TASKS];
+static unsigned char ready_next[SCHED_MAX_TASKS];
+static unsigned char ready_head[SCHED_PRIO_LEVELS];
+static unsigned char ready_tail[SCHED_PRIO_LEVELS];
+static unsigned char ready_levels = 0; /* bit n set: level n has ready tasks */
+static unsigned char task_prio[SCHED_MAX_TASKS];  /* as given to scheduler_add_prio */
+static unsigned char task_eprio[SCHED_MAX_TASKS]; /* queue level, raised by aging */
+#if SCHED_PRIO_AGING > 0
+static unsigned char level_starve[SCHED_PRIO_LEVELS];
+#endif
+static unsigned char sleep_next[SCHED_MAX_TASKS];
+static unsigned char sleep_head = TASK_NONE;
+static unsigned char wait_next[SCHED_MAX_TASKS];
+static scheduler_waitq_t *task_waitq[SCHED_MAX_TASKS]; /* queue a task blocks on */
+static unsigned char task_wait_mask[SCHED_MAX_TASKS];  /* event bits waited for */
+static unsigned char task_wait_mode[SCHED_MAX_TASKS];
 
 static int current = -1;
 static unsigned short ticks = 0;
@@ -34,9 +67,148 @@ static unsigned long cpu_active_ticks = 0;
 static unsigned long cpu_total_ticks = 0;
 static int idle_task_id = -1; /* task index reserved for idle */
 
+/* ========== Tick source ========== */
+
+#if SCHED_TICK_SOURCE == SCHED_TICK_VSYNC
+static unsigned char tick_last;
+
+static void tick_source_init(void)
+{
+    tick_last = RIA.vsync;
+}
+
+/* Frames since the last poll */
+static unsigned short tick_source_poll(void)
+{
+    unsigned char now = RIA.vsync;
+    unsigned char elapsed = (unsigned char)(now - tick_last);
+    tick_last = now;
+    return elapsed;
+}
+#elif SCHED_TICK_SOURCE == SCHED_TICK_CLOCK
+static unsigned long tick_last;
+static unsigned long tick_divisor = 1;
+
+static unsigned long tick_clock_now(void)
+{
+    return (unsigned long)clock() / tick_divisor;
+}
+
+static void tick_source_init(void)
+{
+    tick_divisor = (unsigned long)CLOCKS_PER_SEC / SCHED_TICK_HZ;
+    if (tick_divisor == 0) tick_divisor = 1;
+    tick_last = tick_clock_now();
+}
+
+/* SCHED_TICK_HZ periods since the last poll */
+static unsigned short tick_source_poll(void)
+{
+    unsigned long now = tick_clock_now();
+    unsigned long elapsed = now - tick_last;
+    tick_last = now;
+    return elapsed > 0xFFFFu ? 0xFFFFu : (unsigned short)elapsed;
+}
+#else
+#define tick_source_init()
+#define tick_source_poll() 1
+#endif
+
 /* Assembly function provided in ctxswitch.s */
 extern void ctx_switch(void);
 
+/* Hardware stack page, only touched for the partition guard bytes. Host
+ * builds get a stand-in array instead of address $0100. */
+#if SCHED_STACK_PARTITIONS > 0
+#if defined(__CC65__)
+#define PAGE1 ((volatile unsigned char *)0x0100)
+#else
+static unsigned char host_page1[256];
+#define PAGE1 host_page1
+#endif
+#endif
+
+/* Lowest byte of the page 1 area shared by the main context and copy-mode tasks */
+#define SHARED_STACK_GUARD ((unsigned char)(SCHED_STACK_PARTITIONS * SCHED_PARTITION_SIZE))
+
+#if SCHED_STACK_PARTITIONS > 0
+static unsigned char slice_used[SCHED_STACK_PARTITIONS];
+#endif
+
+/* ctxswitch.s copies page 1 bytes saved_sp+1..$FF to stack_base[saved_sp+1..$FF],
+ * starting no lower than ctx_stack_floor. Offsetting the base keeps stack[]
+ * holding the top SCHED_TASK_STACK_SIZE bytes of page 1 when the buffer is
+ * smaller than a full page.
+ */
+static void task_init_stack_base(task_t *t)
+{
+#if SCHED_TASK_STACK_SIZE < 256
+    t->stack_base = t->stack - (256 - SCHED_TASK_STACK_SIZE);
+#else
+    t->stack_base = t->stack;
+#endif
+    t->stack_top = 0xFF;
+    t->stack_guard = SHARED_STACK_GUARD;
+    t->slice = 0xFF;
+    t->overflow = 0;
+}
+
+/* Place a task in a free page 1 partition, or in copy mode if none is free */
+static void task_assign_stack(task_t *t, unsigned char deep)
+{
+#if SCHED_STACK_PARTITIONS > 0
+    unsigned char k;
+    if (!deep) {
+        for (k = 0; k < SCHED_STACK_PARTITIONS; ++k) {
+            if (!slice_used[k]) {
+                slice_used[k] = 1;
+                t->slice = k;
+                t->stack_base = (unsigned char *)0;
+                t->stack_guard = (unsigned char)(k * SCHED_PARTITION_SIZE);
+                t->stack_top = (unsigned char)(t->stack_guard + SCHED_PARTITION_SIZE - 1);
+                t->overflow = 0;
+                PAGE1[t->stack_guard] = SCHED_STACK_GUARD;
+                return;
+            }
+        }
+    }
+#endif
+    (void)deep;
+    task_init_stack_base(t);
+}
+
+/* Free the task's partition. The stack fields are left alone: a task that
+ * returns is still running on them until ctx_switch moves away, and
+ * task_assign_stack sets them up again for the next task in this slot. */
+static void task_release_stack(task_t *t)
+{
+#if SCHED_STACK_PARTITIONS > 0
+    if (t->slice != 0xFF) slice_used[t->slice] = 0;
+#else
+    (void)t;
+#endif
+}
+
+/* Point the task at an empty C stack. The region is filled with the guard
+ * value so the high-water mark can be read back later; byte 0 is the guard. */
+static void task_init_cstack(int id)
+{
+    unsigned int j;
+    for (j = 0; j < SCHED_TASK_CSTACK_SIZE; ++j) task_cstacks[id][j] = SCHED_STACK_GUARD;
+    tasks[id].csp = &task_cstacks[id][SCHED_TASK_CSTACK_SIZE];
+    for (j = 0; j < sizeof(tasks[id].regbank); ++j) tasks[id].regbank[j] = 0;
+}
+
+/* Check the guard bytes below the task's stacks; O(1) per switch */
+static void task_check_guard(int id)
+{
+    task_t *t = &tasks[id];
+    if (task_cstacks[id][0] != SCHED_STACK_GUARD) t->overflow = 1;
+#if SCHED_STACK_PARTITIONS > 0
+    if (PAGE1[t->stack_guard] != SCHED_STACK_GUARD) t->overflow = 1;
+#endif
+}
+
 void scheduler_init(void)
 {
     int i;
@@ -48,55 +220,197 @@ void scheduler_init(void)
         tasks[i].started = 0;
         tasks[i].saved_sp = 0xFF;
         tasks[i].a = tasks[i].x = tasks[i].y = tasks[i].p = 0;
-        tasks[i].wake_tick = 0;
+        tasks[i].wake_delta = 0;
+        task_init_stack_base(&tasks[i]);
         {
             unsigned int j;
             for (j = 0; j < SCHED_TASK_STACK_SIZE; ++j) tasks[i].stack[j] = 0;
         }
     }
+    task_init_stack_base(&scheduler_ctx);
     scheduler_ctx.in_use = 1;
     current = -1;
+    for (i = 0; i < SCHED_MAX_TASKS; ++i) task_state[i] = TASK_FREE;
+    for (i = 0; i < SCHED_PRIO_LEVELS; ++i) {
+        ready_head[i] = ready_tail[i] = TASK_NONE;
+#if SCHED_PRIO_AGING > 0
+        level_starve[i] = 0;
+#endif
+    }
+    ready_levels = 0;
+    sleep_head = TASK_NONE;
+    tick_source_init();
+#if SCHED_STACK_PARTITIONS > 0
+    for (i = 0; i < SCHED_STACK_PARTITIONS; ++i) slice_used[i] = 0;
+    PAGE1[SHARED_STACK_GUARD] = SCHED_STACK_GUARD;
+#endif
 }
 
-static int find_next_task(int from)
+static void ready_push(unsigned char id)
 {
-    int i, start;
-    if (from < 0) start = 0; else start = (from + 1) % SCHED_MAX_TASKS;
-    /* First, try to find a non-idle runnable task */
-    for (i = 0; i < SCHED_MAX_TASKS; ++i) {
-        int idx = (start + i) % SCHED_MAX_TASKS;
-        if (!tasks[idx].in_use) continue;
-        if (idx == idle_task_id) continue; /* prefer non-idle tasks */
-        /* skip sleeping tasks (wake_tick==0 means ready) */
-        if (tasks[idx].wake_tick != 0) {
-            unsigned short diff = (unsigned short)(ticks - tasks[idx].wake_tick);
-            if (diff >= 0x8000u) continue; /* wake time not reached */
-        }
-        return idx;
+    unsigned char level = task_eprio[id];
+    task_state[id] = TASK_READY;
+    if ((int)id == idle_task_id) return; /* idle runs only when nothing else is ready */
+    ready_next[id] = TASK_NONE;
+    if (ready_tail[level] == TASK_NONE) ready_head[level] = id;
+    else ready_next[ready_tail[level]] = id;
+    ready_tail[level] = id;
+    ready_levels |= (unsigned char)(1u << level);
+}
+
+/* Detach the head of a non-empty level */
+static unsigned char ready_take(unsigned char level)
+{
+    unsigned char id = ready_head[level];
+    ready_head[level] = ready_next[id];
+    if (ready_head[level] == TASK_NONE) {
+        ready_tail[level] = TASK_NONE;
+        ready_levels &= (unsigned char)~(1u << level);
     }
-    /* If none found, fall back to idle task if it's runnable */
-    if (idle_task_id >= 0 && idle_task_id < SCHED_MAX_TASKS && tasks[idle_task_id].in_use) {
-        /* check wake_tick */
-        if (tasks[idle_task_id].wake_tick == 0 || (unsigned short)(ticks - tasks[idle_task_id].wake_tick) < 0x8000u) {
-            return idle_task_id;
-        }
+    return id;
+}
+
+#if SCHED_PRIO_AGING > 0
+/* Count a pick that passed over each waiting level below `level`; a level
+ * passed over SCHED_PRIO_AGING times moves its head up one level. */
+static void ready_age(unsigned char level)
+{
+    unsigned char l;
+    unsigned char id;
+    for (l = (unsigned char)(level + 1); l < SCHED_PRIO_LEVELS; ++l) {
+        if (!(ready_levels & (1u << l))) continue;
+        if (++level_starve[l] < SCHED_PRIO_AGING) continue;
+        level_starve[l] = 0;
+        id = ready_take(l);
+        task_eprio[id] = (unsigned char)(l - 1);
+        ready_push(id);
     }
-    /* Otherwise, try any runnable task as a last resort (including idle) */
-    for (i = 0; i < SCHED_MAX_TASKS; ++i) {
-        int idx = (start + i) % SCHED_MAX_TASKS;
-        if (!tasks[idx].in_use) continue;
-        if (tasks[idx].wake_tick != 0) {
-            unsigned short diff = (unsigned short)(ticks - tasks[idx].wake_tick);
-            if (diff >= 0x8000u) continue;
-        }
-        return idx;
+}
+#endif
+
+static int ready_pop(void)
+{
+    unsigned char level;
+    unsigned char id;
+    if (!ready_levels) {
+        if (idle_task_id >= 0 && task_state[idle_task_id] == TASK_READY) return idle_task_id;
+        return -1;
     }
-    return -1;
+    for (level = 0; !(ready_levels & (1u << level)); ++level) ;
+#if SCHED_PRIO_AGING > 0
+    ready_age(level);
+    level_starve[level] = 0;
+#endif
+    id = ready_take(level);
+    /* a boost lasts until the task is picked */
+    task_eprio[id] = task_prio[id];
+    return id;
 }
 
-int scheduler_add(scheduler_task_fn fn, void *arg)
+/* O(n) unlink; only used when a queued task is removed or becomes idle */
+static void ready_unlink(unsigned char id)
+{
+    unsigned char level = task_eprio[id];
+    unsigned char i = ready_head[level];
+    unsigned char prev = TASK_NONE;
+    while (i != TASK_NONE && i != id) {
+        prev = i;
+        i = ready_next[i];
+    }
+    if (i == TASK_NONE) return;
+    if (prev == TASK_NONE) ready_head[level] = ready_next[id];
+    else ready_next[prev] = ready_next[id];
+    if (ready_tail[level] == id) ready_tail[level] = prev;
+    if (ready_head[level] == TASK_NONE) ready_levels &= (unsigned char)~(1u << level);
+}
+
+/* Insert a sleeper waking delta ticks from now (delta >= 1); equal
+ * wakeups keep their sleep order */
+static void sleep_insert(unsigned char id, unsigned short delta)
+{
+    unsigned char i = sleep_head;
+    unsigned char prev = TASK_NONE;
+    while (i != TASK_NONE && delta >= tasks[i].wake_delta) {
+        delta -= tasks[i].wake_delta;
+        prev = i;
+        i = sleep_next[i];
+    }
+    tasks[id].wake_delta = delta;
+    sleep_next[id] = i;
+    if (prev == TASK_NONE) sleep_head = id;
+    else sleep_next[prev] = id;
+    if (i != TASK_NONE) tasks[i].wake_delta -= delta;
+    task_state[id] = TASK_SLEEPING;
+}
+
+static void sleep_unlink(unsigned char id)
+{
+    unsigned char i = sleep_head;
+    unsigned char prev = TASK_NONE;
+    while (i != TASK_NONE && i != id) {
+        prev = i;
+        i = sleep_next[i];
+    }
+    if (i == TASK_NONE) return;
+    i = sleep_next[id];
+    if (prev == TASK_NONE) sleep_head = i;
+    else sleep_next[prev] = i;
+    /* the successor inherits the remaining delay */
+    if (i != TASK_NONE) tasks[i].wake_delta += tasks[id].wake_delta;
+}
+
+/* Advance the clock by n ticks and move every sleeper that became due
+ * to the ready queue */
+static void tick_advance(unsigned short n)
+{
+    unsigned char id;
+    ticks += n;
+    while (sleep_head != TASK_NONE && n >= tasks[sleep_head].wake_delta) {
+        id = sleep_head;
+        n -= tasks[id].wake_delta;
+        sleep_head = sleep_next[id];
+        ready_push(id);
+    }
+    if (sleep_head != TASK_NONE) tasks[sleep_head].wake_delta -= n;
+}
+
+/* Pick the next task to run, or -1 if nothing is runnable */
+static int pick_next_task(void)
+{
+    int next = ready_pop();
+    while (next < 0 && sleep_head != TASK_NONE) {
+#if SCHED_TICK_SOURCE == SCHED_TICK_YIELD
+        /* Everyone is asleep; ticks count switches, so skip to the next wakeup */
+        unsigned short skip = tasks[sleep_head].wake_delta;
+        cpu_total_ticks += skip;
+        tick_advance(skip);
+#else
+        /* Everyone is asleep; wait for the tick source */
+        tick_advance(tick_source_poll());
+#endif
+        next = ready_pop();
+    }
+    return next;
+}
+
+static void waitq_unlink(scheduler_waitq_t *q, unsigned char id)
+{
+    unsigned char i = q->head;
+    unsigned char prev = TASK_NONE;
+    while (i != TASK_NONE && i != id) {
+        prev = i;
+        i = wait_next[i];
+    }
+    if (i == TASK_NONE) return;
+    if (prev == TASK_NONE) q->head = wait_next[id];
+    else wait_next[prev] = wait_next[id];
+    if (q->tail == id) q->tail = prev;
+}
+
+static int task_add(scheduler_task_fn fn, void *arg, unsigned char deep, unsigned char prio)
 {
     int i;
+    if (prio >= SCHED_PRIO_LEVELS) prio = SCHED_PRIO_LEVELS - 1;
     for (i = 0; i < SCHED_MAX_TASKS; ++i) {
         if (!tasks[i].in_use) {
             tasks[i].fn = fn;
@@ -104,14 +418,33 @@ int scheduler_add(scheduler_task_fn fn, void *arg)
             tasks[i].in_use = 1;
             tasks[i].one_shot = 0;
             tasks[i].started = 0;
-            tasks[i].saved_sp = 0xFF;
-            tasks[i].wake_tick = 0;
+            tasks[i].wake_delta = 0;
+            task_assign_stack(&tasks[i], deep);
+            tasks[i].saved_sp = tasks[i].stack_top;
+            task_init_cstack(i);
+            task_prio[i] = task_eprio[i] = prio;
+            ready_push((unsigned char)i);
             return i;
         }
     }
     return -1;
 }
 
+int scheduler_add(scheduler_task_fn fn, void *arg)
+{
+    return task_add(fn, arg, 0, SCHED_PRIO_NORMAL);
+}
+
+int scheduler_add_prio(scheduler_task_fn fn, void *arg, unsigned char prio)
+{
+    return task_add(fn, arg, 0, prio);
+}
+
+int scheduler_add_deep(scheduler_task_fn fn, void *arg)
+{
+    return task_add(fn, arg, 1, SCHED_PRIO_NORMAL);
+}
+
 int scheduler_add_once(scheduler_task_fn fn, void *arg)
 {
     int id = scheduler_add(fn,arg);
@@ -122,6 +455,11 @@ int scheduler_add_once(scheduler_task_fn fn, void *arg)
 int scheduler_remove(int id)
 {
     if (id < 0 || id >= SCHED_MAX_TASKS) return -1;
+    if (tasks[id].in_use) task_release_stack(&tasks[id]);
+    if (task_state[id] == TASK_READY) ready_unlink((unsigned char)id);
+    else if (task_state[id] == TASK_SLEEPING) sleep_unlink((unsigned char)id);
+    else if (task_state[id] == TASK_BLOCKED) waitq_unlink(task_waitq[id], (unsigned char)id);
+    task_state[id] = TASK_FREE;
     tasks[id].in_use = 0;
     tasks[id].fn = (scheduler_task_fn)0;
     tasks[id].arg = (void*)0;
@@ -133,7 +471,10 @@ void scheduler_task_return(void)
 {
     /* called when a task function returns: remove it and yield */
     if (current >= 0 && current < SCHED_MAX_TASKS) {
+        /* nothing can claim the freed slice before ctx_switch leaves it */
+        task_release_stack(&tasks[current]);
         tasks[current].in_use = 0;
+        task_state[current] = TASK_FREE;
     }
     /* yield to next task (will not return here) */
     scheduler_yield();
@@ -143,8 +484,188 @@ void scheduler_sleep(unsigned short delta)
 {
     if (current < 0 || current >= SCHED_MAX_TASKS) return;
     if (delta == 0) delta = 1;
-    tasks[current].wake_tick = (unsigned short)(ticks + delta);
+    sleep_insert((unsigned char)current, delta);
+    scheduler_yield();
+}
+
+void scheduler_sleep_until(unsigned short tick)
+{
+    unsigned short delta = (unsigned short)(tick - ticks);
+    /* a target in the past half of the tick range is a missed deadline */
+    if (delta >= 0x8000u) delta = 0;
+    if (delta == 0) {
+        scheduler_yield();
+        return;
+    }
+    scheduler_sleep(delta);
+}
+
+/* ========== Wait queues, semaphores, event flags ========== */
+
+void scheduler_waitq_init(scheduler_waitq_t *q)
+{
+    q->head = q->tail = TASK_NONE;
+}
+
+/* Block the current task on q until woken. Returns -1 without blocking
+ * if nothing else could run to wake it. */
+static int block_current(scheduler_waitq_t *q)
+{
+    unsigned char id;
+    if (current < 0 || current >= SCHED_MAX_TASKS) return -1;
+    id = (unsigned char)current;
+    task_state[id] = TASK_BLOCKED;
+    task_waitq[id] = q;
+    wait_next[id] = TASK_NONE;
+    if (q->tail == TASK_NONE) q->head = id;
+    else wait_next[q->tail] = id;
+    q->tail = id;
     scheduler_yield();
+    if (task_state[id] == TASK_BLOCKED) {
+        /* scheduler_yield found nothing to switch to: deadlock */
+        waitq_unlink(q, id);
+        task_state[id] = TASK_RUNNING;
+        return -1;
+    }
+    return 0;
+}
+
+int scheduler_wait(scheduler_waitq_t *q)
+{
+    return block_current(q);
+}
+
+int scheduler_wake_one(scheduler_waitq_t *q)
+{
+    unsigned char id = q->head;
+    if (id == TASK_NONE) return 0;
+    q->head = wait_next[id];
+    if (q->head == TASK_NONE) q->tail = TASK_NONE;
+    ready_push(id);
+    return 1;
+}
+
+unsigned char scheduler_wake_all(scheduler_waitq_t *q)
+{
+    unsigned char n = 0;
+    while (scheduler_wake_one(q)) ++n;
+    return n;
+}
+
+void scheduler_sem_init(scheduler_sem_t *sem, unsigned int count)
+{
+    sem->count = count;
+    scheduler_waitq_init(&sem->waiters);
+}
+
+int scheduler_sem_wait(scheduler_sem_t *sem)
+{
+    if (sem->count) {
+        --sem->count;
+        return 0;
+    }
+    /* scheduler_sem_post hands the token over without touching count */
+    return block_current(&sem->waiters);
+}
+
+int scheduler_sem_trywait(scheduler_sem_t *sem)
+{
+    if (!sem->count) return 0;
+    --sem->count;
+    return 1;
+}
+
+void scheduler_sem_post(scheduler_sem_t *sem)
+{
+    if (!scheduler_wake_one(&sem->waiters)) ++sem->count;
+}
+
+void scheduler_event_init(scheduler_event_t *ev)
+{
+    ev->flags = 0;
+    scheduler_waitq_init(&ev->waiters);
+}
+
+static unsigned char event_satisfied(unsigned char flags, unsigned char mask, unsigned char mode)
+{
+    if (mode == SCHED_EVENT_ALL) return (unsigned char)((flags & mask) == mask);
+    return (unsigned char)((flags & mask) != 0);
+}
+
+void scheduler_event_set(scheduler_event_t *ev, unsigned char mask)
+{
+    unsigned char i = ev->waiters.head;
+    unsigned char nxt;
+    ev->flags |= mask;
+    while (i != TASK_NONE) {
+        nxt = wait_next[i];
+        if (event_satisfied(ev->flags, task_wait_mask[i], task_wait_mode[i])) {
+            waitq_unlink(&ev->waiters, i);
+            ready_push(i);
+        }
+        i = nxt;
+    }
+}
+
+void scheduler_event_clear(scheduler_event_t *ev, unsigned char mask)
+{
+    ev->flags &= (unsigned char)~mask;
+}
+
+int scheduler_event_wait(scheduler_event_t *ev, unsigned char mask, unsigned char mode)
+{
+    if (!event_satisfied(ev->flags, mask, mode)) {
+        if (current < 0 || current >= SCHED_MAX_TASKS) return -1;
+        task_wait_mask[current] = mask;
+        task_wait_mode[current] = mode;
+        if (block_current(&ev->waiters) < 0) return -1;
+    }
+    /* flags may have been cleared again before this task ran */
+    return ev->flags & mask;
+}
+
+static unsigned char mutex_self(void)
+{
+    return current < 0 ? SCHED_MUTEX_MAIN : (unsigned char)current;
+}
+
+void scheduler_mutex_init(scheduler_mutex_t *m)
+{
+    m->owner = SCHED_MUTEX_FREE;
+    scheduler_waitq_init(&m->waiters);
+}
+
+int scheduler_mutex_lock(scheduler_mutex_t *m)
+{
+    unsigned char self = mutex_self();
+    if (m->owner == SCHED_MUTEX_FREE) {
+        m->owner = self;
+        return 0;
+    }
+    if (m->owner == self) return -1;
+    /* scheduler_mutex_unlock makes us the owner before waking us */
+    return block_current(&m->waiters);
+}
+
+int scheduler_mutex_trylock(scheduler_mutex_t *m)
+{
+    if (m->owner != SCHED_MUTEX_FREE) return 0;
+    m->owner = mutex_self();
+    return 1;
+}
+
+int scheduler_mutex_unlock(scheduler_mutex_t *m)
+{
+    unsigned char id;
+    if (m->owner != mutex_self()) return -1;
+    id = m->waiters.head;
+    if (id == TASK_NONE) {
+        m->owner = SCHED_MUTEX_FREE;
+        return 0;
+    }
+    m->owner = id;
+    scheduler_wake_one(&m->waiters);
+    return 0;
 }
 
 void scheduler_start_task(void)
@@ -163,16 +684,18 @@ void scheduler_yield(void)
 {
     int prev = current;
     int next;
-    /* advance tick (one tick per yield/context switch) */
-    ++ticks;
     ++cpu_total_ticks;
-    next = find_next_task(prev);
+    if (prev >= 0 && task_state[prev] == TASK_RUNNING) ready_push((unsigned char)prev);
+    tick_advance(tick_source_poll());
+    next = pick_next_task();
     if (next < 0) return; /* nothing to run */
+    task_state[next] = TASK_RUNNING;
 
     if (prev < 0) {
         ctx_cur = &scheduler_ctx;
     } else {
         ctx_cur = &tasks[prev];
+        task_check_guard(prev);
     }
     ctx_next = &tasks[next];
     current = next;
@@ -187,8 +710,13 @@ void scheduler_yield(void)
 /* Set/get idle task id used for CPU accounting */
 void scheduler_set_idle_task(int id)
 {
-    if (id >= 0 && id < SCHED_MAX_TASKS) idle_task_id = id;
-    else idle_task_id = -1;
+    int old = idle_task_id;
+    if (id < 0 || id >= SCHED_MAX_TASKS) id = -1;
+    if (id == old) return;
+    /* the new idle task leaves the ready FIFO, the old one joins it */
+    if (id >= 0 && task_state[id] == TASK_READY) ready_unlink((unsigned char)id);
+    idle_task_id = id;
+    if (old >= 0 && task_state[old] == TASK_READY) ready_push((unsigned char)old);
 }
 
 int scheduler_get_idle_task(void)
@@ -196,48 +724,11 @@ int scheduler_get_idle_task(void)
     return idle_task_id;
 }
 
-/* C helper called from assembly to copy stacks between hardware stack and task buffers.
- * It expects ctx_cur and ctx_next to be set to task_t* pointers.
- */
-void scheduler_copy_stacks(void)
-{
-    task_t *cur = (task_t*)ctx_cur;
-    task_t *next = (task_t*)ctx_next;
-    unsigned int i;
-    /* copy only the used portion of the hardware stack into cur->stack
-     * saved_sp holds the X register value at the time of save (0..255).
-     * used bytes are from saved_sp+1 .. PAGE_STACK_SIZE-1 (inclusive).
-     * For safety cap the copy size to the actual 6502 hardware stack page
-     * size (256 bytes) so builds with a larger SCHED_TASK_STACK_SIZE do not
-     * read/write beyond $01FF and corrupt memory.
-     */
-    {
-        const unsigned int PAGE_STACK_SIZE = 256u;
-        const unsigned int max_copy = (SCHED_TASK_STACK_SIZE < PAGE_STACK_SIZE) ? SCHED_TASK_STACK_SIZE : PAGE_STACK_SIZE;
-        unsigned int start = (unsigned int)cur->saved_sp + 1u;
-        if (start < max_copy) {
-            for (i = start; i < max_copy; ++i) {
-                cur->stack[i] = *((unsigned char*)(0x0100 + i));
-            }
-        }
-    }
-    /* restore only the used portion of next->stack back into hardware stack */
-    {
-        const unsigned int PAGE_STACK_SIZE = 256u;
-        const unsigned int max_copy = (SCHED_TASK_STACK_SIZE < PAGE_STACK_SIZE) ? SCHED_TASK_STACK_SIZE : PAGE_STACK_SIZE;
-        unsigned int start = (unsigned int)next->saved_sp + 1u;
-        if (start < max_copy) {
-            for (i = start; i < max_copy; ++i) {
-                *((unsigned char*)(0x0100 + i)) = next->stack[i];
-            }
-        }
-    }
-}
-
 void scheduler_run(void)
 {
-    int first = find_next_task(-1);
+    int first = pick_next_task();
     if (first < 0) return;
+    task_state[first] = TASK_RUNNING;
     ctx_cur = &scheduler_ctx;
     ctx_next = &tasks[first];
     current = first;
@@ -246,8 +737,8 @@ void scheduler_run(void)
 
 unsigned int scheduler_memory_usage(void)
 {
-    /* Return the size of the tasks array + scheduler_ctx as an approximation */
-    return (unsigned int)(sizeof(tasks) + sizeof(scheduler_ctx));
+    /* Return the size of the tasks array + scheduler_ctx + C stacks as an approximation */
+    return (unsigned int)(sizeof(tasks) + sizeof(scheduler_ctx) + sizeof(task_cstacks));
 }
 
 unsigned int scheduler_task_stack_used(int id)
@@ -257,9 +748,8 @@ unsigned int scheduler_task_stack_used(int id)
     if (id < 0 || id >= SCHED_MAX_TASKS) return 0;
     /* saved_sp holds the SP value at time of save (0..255); 0xFF means unused/empty */
     sp = tasks[id].saved_sp;
-    if (sp == (unsigned char)0xFF) return 0;
-    if ((unsigned int)sp + 1 >= SCHED_TASK_STACK_SIZE) return 0;
-    used = (unsigned int)(SCHED_TASK_STACK_SIZE - ((unsigned int)sp + 1));
+    if (sp >= tasks[id].stack_top) return 0;
+    used = (unsigned int)(tasks[id].stack_top - sp);
     /* update high-water mark */
     if (used > task_max_stack[id]) task_max_stack[id] = used;
     return used;
@@ -281,11 +771,61 @@ unsigned int scheduler_task_max_used(int id)
     return task_max_stack[id];
 }
 
+unsigned int scheduler_task_cstack_max_used(int id)
+{
+    unsigned int j;
+    if (id < 0 || id >= SCHED_MAX_TASKS) return 0;
+    /* skip the guard byte, then count untouched fill from the bottom */
+    for (j = 1; j < SCHED_TASK_CSTACK_SIZE; ++j) {
+        if (task_cstacks[id][j] != SCHED_STACK_GUARD) break;
+    }
+    return (unsigned int)(SCHED_TASK_CSTACK_SIZE - j);
+}
+
+unsigned char scheduler_task_overflowed(int id)
+{
+    if (id < 0 || id >= SCHED_MAX_TASKS) return 0;
+    return tasks[id].overflow;
+}
+
+/* Check every live task's guard byte; return the first overflowed id or -1 */
+int scheduler_check_stacks(void)
+{
+    int i;
+    for (i = 0; i < SCHED_MAX_TASKS; ++i) {
+        if (!tasks[i].in_use) continue;
+        task_check_guard(i);
+        if (tasks[i].overflow) return i;
+    }
+    return -1;
+}
+
 unsigned int scheduler_get_ticks(void)
 {
     return (unsigned int)ticks;
 }
 
+unsigned int scheduler_ticks_per_second(void)
+{
+#if SCHED_TICK_SOURCE == SCHED_TICK_VSYNC
+    return 60;
+#elif SCHED_TICK_SOURCE == SCHED_TICK_CLOCK
+    return SCHED_TICK_HZ;
+#else
+    return 0;
+#endif
+}
+
+unsigned short scheduler_ms_to_ticks(unsigned int ms)
+{
+    unsigned int tps = scheduler_ticks_per_second();
+    unsigned long t;
+    if (tps == 0) t = ms;
+    else t = ((unsigned long)ms * tps + 999UL) / 1000UL;
+    if (t == 0) t = 1;
+    return t > 0xFFFFUL ? 0xFFFFu : (unsigned short)t;
+}
+
 /* Return CPU usage percent (0-100), computed as (active_ticks * 100) / total_ticks. */
 unsigned int scheduler_cpu_usage_percent(void)
 {
@@ -22,24 +22,205 @@ unsigned int scheduler_get_cpu_frequency(void);
  * per-task buffers. Therefore `SCHED_TASK_STACK_SIZE` must be <= 256 or the
  * scheduler will attempt to read/write beyond the hardware stack page and
  * corrupt memory, leading to hangs. Enforce this at compile time.
+ * A smaller buffer holds the top SCHED_TASK_STACK_SIZE bytes of page 1. A
+ * copy-mode task that goes deeper than that is marked overflowed (see
+ * scheduler_task_overflowed) and the bytes below its buffer are not saved.
  */
 #if SCHED_TASK_STACK_SIZE > 256
 #error "SCHED_TASK_STACK_SIZE must be <= 256 because the 6502 hardware stack is 256 bytes"
 #endif
 
+/* Size of each task's cc65 software (C) stack. ctx_switch saves and
+ * restores the runtime's `sp` and `regbank` per task, so tasks may use
+ * ordinary locals and recursion. The lowest byte holds SCHED_STACK_GUARD.
+ */
+#ifndef SCHED_TASK_CSTACK_SIZE
+#define SCHED_TASK_CSTACK_SIZE 256
+#endif
+
+#if SCHED_TASK_CSTACK_SIZE < 32
+#error "SCHED_TASK_CSTACK_SIZE must be at least 32 bytes"
+#endif
+
+/* Partitioned hardware-stack mode. When SCHED_STACK_PARTITIONS > 0 the
+ * bottom of page 1 is carved into that many fixed slices of
+ * SCHED_PARTITION_SIZE bytes. A task placed in a slice keeps its stack
+ * there, so switching to or from it only swaps SP. The rest of page 1 is
+ * shared by the main context and copy-mode tasks, which are still saved to
+ * task_t.stack[] as before (scheduler_add_deep, or scheduler_add once all
+ * slices are taken). The lowest byte of every slice and of the shared area
+ * holds SCHED_STACK_GUARD and is checked whenever its owner switches out.
+ */
+#ifndef SCHED_STACK_PARTITIONS
+#define SCHED_STACK_PARTITIONS 0
+#endif
+
+#ifndef SCHED_PARTITION_SIZE
+#define SCHED_PARTITION_SIZE 32
+#endif
+
+#ifndef SCHED_STACK_GUARD
+#define SCHED_STACK_GUARD 0xA5
+#endif
+
+/* Keep at least 32 bytes of page 1 for the main context */
+#if SCHED_STACK_PARTITIONS * SCHED_PARTITION_SIZE > 224
+#error "SCHED_STACK_PARTITIONS * SCHED_PARTITION_SIZE must leave 32 bytes of page 1 unpartitioned"
+#endif
+
+#if SCHED_STACK_PARTITIONS > SCHED_MAX_TASKS
+#error "SCHED_STACK_PARTITIONS must not exceed SCHED_MAX_TASKS"
+#endif
+
+/* Tick source: what advances scheduler_get_ticks() and times sleeps.
+ *   SCHED_TICK_YIELD  one tick per context switch; deterministic, used by
+ *                     the sim65 benchmarks and emulators without a clock
+ *   SCHED_TICK_VSYNC  RIA VSYNC frame counter, 60 ticks per second
+ *   SCHED_TICK_CLOCK  C clock(), scaled to SCHED_TICK_HZ ticks per second
+ * The default is VSYNC on the RP6502, YIELD on other cc65 targets and
+ * CLOCK on the host build. Real-time sources are polled on every switch;
+ * the 8-bit VSYNC counter must be polled at least every 255 frames.
+ */
+#define SCHED_TICK_YIELD 0
+#define SCHED_TICK_VSYNC 1
+#define SCHED_TICK_CLOCK 2
+
+#ifndef SCHED_TICK_SOURCE
+#if defined(__RP6502__)
+#define SCHED_TICK_SOURCE SCHED_TICK_VSYNC
+#elif defined(__CC65__)
+#define SCHED_TICK_SOURCE SCHED_TICK_YIELD
+#else
+#define SCHED_TICK_SOURCE SCHED_TICK_CLOCK
+#endif
+#endif
+
+#ifndef SCHED_TICK_HZ
+#define SCHED_TICK_HZ 100
+#endif
+
+/* Priority levels: 0 is the highest. The highest level with a ready task
+ * always runs next, round-robin within the level. A waiting level passed
+ * over SCHED_PRIO_AGING times has its oldest task raised one level until
+ * it runs (0 disables aging). At most 8 levels.
+ */
+#ifndef SCHED_PRIO_LEVELS
+#define SCHED_PRIO_LEVELS 3
+#endif
+
+#ifndef SCHED_PRIO_AGING
+#define SCHED_PRIO_AGING 8
+#endif
+
+#if SCHED_PRIO_LEVELS < 1 || SCHED_PRIO_LEVELS > 8
+#error "SCHED_PRIO_LEVELS must be 1..8"
+#endif
+
+#define SCHED_PRIO_HIGH 0
+#define SCHED_PRIO_NORMAL (SCHED_PRIO_LEVELS > 1 ? 1 : 0)
+#define SCHED_PRIO_LOW (SCHED_PRIO_LEVELS - 1)
+
 typedef void (*scheduler_task_fn)(void *);
 
 /* Scheduler API */
 void scheduler_init(void);
 int scheduler_add(scheduler_task_fn fn, void *arg);
 int scheduler_add_once(scheduler_task_fn fn, void *arg);
+/* Add a task at priority level prio (SCHED_PRIO_HIGH..SCHED_PRIO_LOW);
+ * scheduler_add uses SCHED_PRIO_NORMAL */
+int scheduler_add_prio(scheduler_task_fn fn, void *arg, unsigned char prio);
+/* Add a task that always uses the stack-copying mode (for deep stacks) */
+int scheduler_add_deep(scheduler_task_fn fn, void *arg);
 int scheduler_remove(int id);
 void scheduler_run(void);
 void scheduler_yield(void);
 void scheduler_task_return(void);
 void scheduler_start_task(void);
+/* Sleep for 1..65535 ticks. With a real-time source the first tick may be
+ * partial: the task wakes on the ticks-th tick boundary from now. */
 void scheduler_sleep(unsigned short ticks);
+/* Sleep until scheduler_get_ticks() reaches tick. A tick up to 32767
+ * behind is treated as already passed, and the call only yields. */
+void scheduler_sleep_until(unsigned short tick);
 unsigned int scheduler_get_ticks(void);
+/* Ticks per second of the tick source, or 0 for SCHED_TICK_YIELD */
+unsigned int scheduler_ticks_per_second(void);
+/* Convert milliseconds to a sleep length (at least 1 tick). Under
+ * SCHED_TICK_YIELD ticks have no duration and ms is returned as is. */
+unsigned short scheduler_ms_to_ticks(unsigned int ms);
+
+/* Blocking primitives. A task waiting on one of these leaves the run set
+ * until it is signalled; waiters are woken in FIFO order. The wait calls
+ * return -1 instead of blocking when no other task could ever wake the
+ * caller (nothing ready or sleeping), or when called outside a task.
+ */
+typedef struct {
+    unsigned char head; /* first waiting task id, 0xFF if none */
+    unsigned char tail;
+} scheduler_waitq_t;
+
+#define SCHEDULER_WAITQ_INIT { 0xFF, 0xFF }
+
+void scheduler_waitq_init(scheduler_waitq_t *q);
+/* True if no task is waiting; cheap enough to test before every wake */
+#define scheduler_waitq_empty(q) ((q)->head == 0xFF)
+int scheduler_wait(scheduler_waitq_t *q);
+/* Wake the first waiter; returns 1 if a task was woken */
+int scheduler_wake_one(scheduler_waitq_t *q);
+/* Wake every waiter; returns the number woken */
+unsigned char scheduler_wake_all(scheduler_waitq_t *q);
+
+/* Counting semaphore: post hands its token straight to the first waiter */
+typedef struct {
+    unsigned int count;
+    scheduler_waitq_t waiters;
+} scheduler_sem_t;
+
+void scheduler_sem_init(scheduler_sem_t *sem, unsigned int count);
+int scheduler_sem_wait(scheduler_sem_t *sem);
+/* Take a token without blocking; returns 1 on success */
+int scheduler_sem_trywait(scheduler_sem_t *sem);
+void scheduler_sem_post(scheduler_sem_t *sem);
+
+/* Event flags: up to 8 bits that stay set until cleared */
+#define SCHED_EVENT_ANY 0
+#define SCHED_EVENT_ALL 1
+
+typedef struct {
+    unsigned char flags;
+    scheduler_waitq_t waiters;
+} scheduler_event_t;
+
+void scheduler_event_init(scheduler_event_t *ev);
+/* Set bits and wake every waiter whose condition now holds */
+void scheduler_event_set(scheduler_event_t *ev, unsigned char mask);
+void scheduler_event_clear(scheduler_event_t *ev, unsigned char mask);
+/* Wait until any (or all, with SCHED_EVENT_ALL) of mask is set; returns
+ * the flags that satisfied the wait, or -1 */
+int scheduler_event_wait(scheduler_event_t *ev, unsigned char mask, unsigned char mode);
+
+/* Mutex: a free lock is taken without touching the scheduler; contended
+ * lockers block until the holder unlocks, which hands the lock straight
+ * to the first waiter. Not recursive. Usable before scheduler_run, but
+ * only a task can wait for a held lock.
+ */
+#define SCHED_MUTEX_FREE 0xFF
+#define SCHED_MUTEX_MAIN 0xFE /* held outside any task */
+
+typedef struct {
+    unsigned char owner; /* task id, SCHED_MUTEX_MAIN or SCHED_MUTEX_FREE */
+    scheduler_waitq_t waiters;
+} scheduler_mutex_t;
+
+#define SCHEDULER_MUTEX_INIT { SCHED_MUTEX_FREE, SCHEDULER_WAITQ_INIT }
+
+void scheduler_mutex_init(scheduler_mutex_t *m);
+/* Returns 0 once held, -1 on a relock by the holder or a deadlock */
+int scheduler_mutex_lock(scheduler_mutex_t *m);
+/* Returns 1 if the lock was free and is now held */
+int scheduler_mutex_trylock(scheduler_mutex_t *m);
+/* Returns -1 if the caller does not hold the lock */
+int scheduler_mutex_unlock(scheduler_mutex_t *m);
 
 /* Return CPU usage percent (0-100), computed as (active_ticks * 100) / total_ticks. */
 unsigned int scheduler_cpu_usage_percent(void);
@@ -55,6 +236,14 @@ unsigned int scheduler_task_stack_used(int id);
 unsigned int scheduler_total_stack_used(void);
 unsigned int scheduler_task_max_used(int id);
 
+/* High-water mark of a task's C stack (bytes ever written) */
+unsigned int scheduler_task_cstack_max_used(int id);
+
+/* Stack guard status: C stack guards always, page 1 guards in partitioned mode,
+ * and a copy-mode task found deeper than SCHED_TASK_STACK_SIZE */
+unsigned char scheduler_task_overflowed(int id);
+int scheduler_check_stacks(void);
+
 /* Assembly context switch entry (implemented in ctxswitch.s) */
 extern void ctx_switch(void);
 
@@ -0,0 +1,36 @@
+/* scheduler_task.h - task control block shared by scheduler.c and the
+ * context switch back ends (ctxswitch.s on the 6502, host/ctxswitch_host.c
+ * on the development machine). Not part of the public scheduler API.
+ */
+#ifndef SCHEDULER_TASK_H
+#define SCHEDULER_TASK_H
+
+#include "scheduler.h"
+
+/* Task structure layout must match offsets used in ctxswitch.s */
+typedef struct {
+    scheduler_task_fn fn;   /* 0..1 */
+    void *arg;              /* 2..3 */
+    unsigned char in_use;   /* 4 */
+    unsigned char one_shot; /* 5 */
+    unsigned char started;  /* 6 */
+    unsigned char saved_sp; /* 7 */
+    unsigned char a;        /* 8 */
+    unsigned char x;        /* 9 */
+    unsigned char y;        /* 10 */
+    unsigned char p;        /* 11 */
+    unsigned short wake_delta; /* 12..13: ticks after the previous sleeper */
+    /* stack - (256 - SCHED_TASK_STACK_SIZE): lets ctxswitch.s index the
+     * buffer with the page 1 offset, so stack[] holds the top of page 1.
+     * NULL for a task living in a page 1 partition: nothing is copied. */
+    unsigned char *stack_base; /* 14..15 */
+    unsigned char stack_top;   /* 16: initial SP ($FF in copy mode) */
+    unsigned char stack_guard; /* 17: page 1 offset of the guard byte */
+    unsigned char slice;       /* 18: partition index, 0xFF in copy mode */
+    unsigned char overflow;    /* 19: guard byte found overwritten */
+    unsigned char *csp;        /* 20..21: saved cc65 C stack pointer (sp) */
+    unsigned char regbank[6];  /* 22..27: saved cc65 register variables */
+    unsigned char stack[SCHED_TASK_STACK_SIZE]; /* 28.. */
+} task_t;
+
+#endif /* SCHEDULER_TASK_H */
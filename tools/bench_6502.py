@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Run bench_6502 under sim65 and write per-operation cycle counts as CSV.
+
+Every op is run twice with `sim65 -c`: once with the measured section
+enabled (run=1) and once with setup only (run=0). The difference divided by
+the op's problem size is the cycle cost per operation.
+"""
+
+import argparse
+import csv
+import os
+import re
+import subprocess
+import sys
+
+# op name -> default problem size (pubsub sizes must fit one topic queue)
+DEFAULT_OPS = [
+    ("btree_insert", 64),
+    ("btree_get", 64),
+    ("btree_scan", 64),
+    ("btree_delete", 64),
+    ("btree_churn_heap", 64),
+    ("btree_churn_pool", 64),
+    ("btree_task_stack", 64),
+    ("pubsub_publish", 63),
+    ("pubsub_process_topic", 63),
+    ("pubsub_publish_id", 63),
+    ("pubsub_process_id", 63),
+    ("pubsub_dispatch_full", 63),
+    ("pubsub_publish_spsc", 63),
+    ("pubsub_process_spsc", 63),
+    ("pubsub_publish_batch", 63),
+    ("pubsub_process_batch", 63),
+    ("pubsub_reserve_commit", 63),
+    ("pubsub_peek_release", 63),
+    ("pubsub_publish_payload", 63),
+    ("pubsub_process_all_idle", 63),
+    ("ctx_switch", 200),
+    ("ctx_switch_deep", 200),
+    ("yield_sleepers_2", 200),
+    ("yield_sleepers_13", 200),
+]
+
+CYCLES_RE = re.compile(r"(\d+)\s+cycles")
+
+
+def run_sim65(sim65, program, op, n, run, timeout):
+    proc = subprocess.run(
+        [sim65, "-c", program, op, str(n), str(run)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT,
+        universal_newlines=True,
+        timeout=timeout,
+    )
+    match = CYCLES_RE.search(proc.stdout)
+    if not match:
+        raise RuntimeError("no cycle count in sim65 output for %s:\n%s" % (op, proc.stdout))
+    return int(match.group(1)), proc.returncode
+
+
+def git_label():
+    try:
+        return subprocess.check_output(
+            ["git", "rev-parse", "--short", "HEAD"],
+            stderr=subprocess.DEVNULL, universal_newlines=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--sim65", default="sim65", help="path to sim65")
+    parser.add_argument("--program", required=True, help="bench_6502 binary built for sim6502")
+    parser.add_argument("--out", default="-", help="CSV output file (default: stdout)")
+    parser.add_argument("--label", default=None,
+                        help="value for the label column (default: short git commit id)")
+    parser.add_argument("--append", action="store_true",
+                        help="append rows to --out, writing the header only if it is new")
+    parser.add_argument("-n", type=int, default=0, help="override problem size for every op")
+    parser.add_argument("--timeout", type=float, default=60.0, help="per-run timeout in seconds")
+    parser.add_argument("ops", nargs="*", help="ops to run (default: all)")
+    args = parser.parse_args()
+
+    ops = DEFAULT_OPS
+    if args.ops:
+        known = dict(DEFAULT_OPS)
+        unknown = [op for op in args.ops if op not in known]
+        if unknown:
+            parser.error("unknown ops: %s" % ", ".join(unknown))
+        ops = [(op, known[op]) for op in args.ops]
+
+    label = git_label() if args.label is None else args.label
+    header = True
+    if args.out == "-":
+        out = sys.stdout
+    elif args.append:
+        header = not os.path.exists(args.out) or os.path.getsize(args.out) == 0
+        out = open(args.out, "a", newline="")
+    else:
+        out = open(args.out, "w", newline="")
+    writer = csv.writer(out)
+    if header:
+        writer.writerow(["label", "op", "n", "cycles_total", "cycles_setup", "cycles_per_op", "status"])
+
+    failed = False
+    for op, size in ops:
+        n = args.n or size
+        total, rc_run = run_sim65(args.sim65, args.program, op, n, 1, args.timeout)
+        setup, rc_setup = run_sim65(args.sim65, args.program, op, n, 0, args.timeout)
+        ok = rc_run == 0 and rc_setup == 0
+        failed = failed or not ok
+        per_op = (total - setup) / n if n else 0
+        writer.writerow([label, op, n, total, setup, "%.1f" % per_op, "ok" if ok else "fail"])
+
+    if out is not sys.stdout:
+        out.close()
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())